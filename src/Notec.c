@@ -5,13 +5,23 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
@@ -22,6 +32,21 @@
 #define NOTEC_VERSION "0.0.1"
 #define NOTEC_TAB_STOP 8
 #define NOTEC_QUIT_TIMES 3
+#define NOTEC_FRAME_MS 16
+#define NOTEC_FRAME_MAX_MS 100
+#define NOTEC_DISK_CHECK_MS 1000
+#define NOTEC_JOURNAL_MS 500
+#define NOTEC_JOURNAL_VERSION 1
+#define NOTEC_UNDO_MAX 16
+#define NOTEC_INDEX_BLOCK 32
+#define NOTEC_BRACKET_BLOCK 64
+#define NOTEC_PANES_MAX 31
+#define NOTEC_DIFF_BUDGET (1LL << 22)
+#define NOTEC_CACHE_MB 64
+#define NOTEC_INDEX_MAGIC "NTRI"
+#define NOTEC_INDEX_VERSION 1
+#define NOTEC_PAGER_STRIDE 4096
+#define NOTEC_PAGER_CHUNK (1 << 20)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -46,14 +71,50 @@ enum editorHighlight {
   HL_KEYWORD2,
   HL_STRING,
   HL_NUMBER,
-  HL_MATCH
+  HL_MATCH,
+  HL_DIFF_ADD,
+  HL_DIFF_CHANGE,
+  HL_DIFF_DELETE
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define CC_SEP (1<<0)
+#define CC_SCS (1<<1)
+#define CC_MCS (1<<2)
+#define CC_MCE (1<<3)
+#define CC_DIGIT (1<<4)
+#define CC_DOT (1<<5)
+#define CC_KEYWORD (1<<6)
+#define CC_ESC (1<<7)
+
+#define NOTEC_HL_QUOTES 16
+
+/* Highlighter states. Each string delimiter gets a pair of states, one for
+ * the string body and one for the byte after a backslash. */
+enum hlState {
+  HS_SEP = 0,
+  HS_WORD,
+  HS_NUMBER,
+  HS_MLCOMMENT,
+  HS_STRING
+};
+
+/* Actions try a multi-byte match before the transition is taken. */
+#define HA_SCS (1<<0)
+#define HA_MCS (1<<1)
+#define HA_MCE (1<<2)
+#define HA_KEYWORD (1<<3)
+
 /*** data ***/
 
+struct hlTrans {
+  unsigned char next;
+  unsigned char hl;
+  unsigned char action;
+};
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -61,7 +122,30 @@ struct editorSyntax {
   char *singleline_comment_start;
   char *multiline_comment_start;
   char *multiline_comment_end;
+  char *string_delimiters;
   int flags;
+  int nkeywords;
+  int *kwlen;
+  unsigned char *kwtype;
+  int kwfirst[257];
+  int scs_len;
+  int mcs_len;
+  int mce_len;
+  unsigned char cclass[256];
+  unsigned char hlclass[256];
+  int nclasses;
+  struct hlTrans *trans;
+};
+
+struct textBuf {
+  int refs;
+  char *data;
+};
+
+struct bracketNode {
+  int sum;
+  int min;
+  int max;
 };
 
 typedef struct erow {
@@ -69,25 +153,362 @@ typedef struct erow {
   int size;
   int rsize;
   char *chars;
+  struct textBuf *shared;
   char *render;
   unsigned char *hl;
   int hl_open_comment;
+  int *cxmap;
+  int needmap;
+  int rwidth;
+  int vlines;
+  uint64_t hash;
+  int cached;
+  int slot;
+  int ref;
+  struct bracketNode br;
 } erow;
 
+struct fenwick {
+  long long *tree;
+  int n;
+  int cap;
+  int stale;
+};
+
+struct fileStamp {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
+struct diskState {
+  struct fileStamp stamp;
+  struct fileStamp seen;
+  uint64_t *hash;
+  int nhash;
+  uint64_t digest;
+  long long verified;
+  int differs;
+  int valid;
+  long long checked;
+};
+
+struct diskLines {
+  char *buf;
+  char **lines;
+  int *lens;
+  uint64_t *hash;
+  int n;
+};
+
+struct cursorSet {
+  int *rows;
+  int *cols;
+  int n;
+  int cap;
+};
+
+struct blockMark {
+  int active;
+  int cy;
+  int rx;
+};
+
+struct selection {
+  int active;
+  int cy;
+  int cx;
+};
+
+struct textSlice {
+  size_t off;
+  int len;
+};
+
+struct textRegister {
+  struct textBuf *buf;
+  struct textSlice *slices;
+  int n;
+  int cap;
+};
+
+struct pane {
+  int used;
+  int parent;
+  int child[2];
+  int vertical;
+  int top, left, rows, cols;
+  int cx, cy;
+  int rowoff, coloff, wrapoff, filteroff;
+  struct buffer *buf;
+};
+
+struct bracketTree {
+  struct bracketNode *node;
+  int size;
+  int *count;
+  unsigned char *dirty;
+  int *pending;
+  int npending;
+  int nblocks;
+  int cap;
+  struct fenwick rows;
+  int relayout;
+  int stale;
+  int mrow;
+  int mri;
+};
+
+struct fold {
+  int start;
+  int end;
+};
+
+struct foldSet {
+  struct fold *folds;
+  int n;
+  int cap;
+  int *hidden;
+};
+
+struct rowFilter {
+  int active;
+  char *pattern;
+  int len;
+  int *rows;
+  int n;
+  int cap;
+  int off;
+};
+
+struct renderCache {
+  long long bytes;
+  long long budget;
+  int *ring;
+  int rows;
+  int cap;
+  int hand;
+  long long hits;
+  long long misses;
+  long long evictions;
+};
+
+struct diffHunk {
+  int a0, a1;
+  int b0, b1;
+};
+
+struct diffView {
+  int active;
+  int stale;
+  struct diffHunk *hunks;
+  int n;
+  int cap;
+};
+
+struct diffJob {
+  const uint64_t *a;
+  const uint64_t *b;
+  int *amap;
+  int *bmap;
+  unsigned char *adel;
+  unsigned char *bins;
+  int *vf;
+  int *vb;
+  int limit;
+  long long cost;
+};
+
+struct filterJob {
+  pthread_t thread;
+  int from;
+  int to;
+  int *rows;
+  int n;
+  int cap;
+};
+
+struct triBlock {
+  unsigned char *bloom;
+  uint32_t mask;
+};
+
+struct triIndex {
+  int enabled;
+  struct triBlock *blocks;
+  int nblocks;
+  int cap;
+  struct fenwick rows;
+  int unbuilt;
+  int next;
+  int relayout;
+  char *path;
+};
+
+struct triQuery {
+  uint32_t hash[32];
+  int n;
+};
+
+struct undoBatch {
+  int n;
+  int cap;
+  int *rows;
+  char **chars;
+  int *sizes;
+  uint64_t *after;
+  int lost;
+  int cx, cy;
+};
+
+struct journal {
+  char *path;
+  int fd;
+  int failed;
+  int paused;
+  int pending;
+  int checked;
+  int running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *buf;
+  int len;
+  int cap;
+  int reset;
+  int stop;
+};
+
+struct codec {
+  char *suffix;
+  char *decompress[3];
+  char *compress[3];
+};
+
+struct stream {
+  int fd;
+  pid_t pid;
+  struct codec *codec;
+};
+
+struct pager {
+  int active;
+  int fd;
+  const char *map;
+  size_t size;
+  size_t top;
+  long long topline;
+  int coloff;
+  char *query;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  long long *marks;
+  int nmarks;
+  int markcap;
+  long long indexed;
+  long long lines;
+  int done;
+};
+
+struct hexView {
+  int active;
+  int fd;
+  int writable;
+  unsigned char *map;
+  size_t size;
+  size_t top;
+  size_t cursor;
+  int nibble;
+  int ascii;
+  int offwidth;
+  size_t page;
+  size_t npages;
+  unsigned char *dirty;
+  size_t ndirty;
+};
+
+struct frameQueue {
+  char *cur;
+  int curlen;
+  int curoff;
+  char *next;
+  int nextlen;
+  int dropped;
+};
+
+/* Everything that belongs to one open file. Panes are views onto a buffer
+ * and E.cur is the buffer of the current pane. */
+struct buffer {
+  int numrows;
+  int rowcap;
+  erow *row;
+  struct fenwick vindex;
+  struct fenwick bindex;
+  int wrapped;
+  int dirty;
+  long long edits;
+  uint64_t digest;
+  char *filename;
+  long long fileoff;
+  int partial;
+  int follow;
+  int followfd;
+  int watchfd;
+  struct diskState disk;
+  struct pager pager;
+  struct hexView hex;
+  struct stream stream;
+  struct journal journal;
+  struct undoBatch undo[NOTEC_UNDO_MAX];
+  int nundo;
+  struct triIndex index;
+  struct cursorSet cursors;
+  struct blockMark block;
+  struct selection sel;
+  struct rowFilter filter;
+  struct diffView diff;
+  struct renderCache cache;
+  struct foldSet folds;
+  struct bracketTree brackets;
+  struct editorSyntax *syntax;
+  int cx, cy;
+  int rowoff, coloff;
+};
+
 struct editorConfig {
   int cx, cy;
   int rx;
   int rowoff;
   int coloff;
+  int wrapoff;
   int screenrows;
   int screencols;
-  int numrows;
-  erow *row;
-  int dirty;
-  char *filename;
+  int screentop;
+  int screenleft;
+  int gutter;
+  int termrows;
+  int termcols;
+  int wrapcols;
+  struct pane panes[NOTEC_PANES_MAX];
+  int curpane;
+  int rootpane;
+  int split;
+  struct buffer *cur;
+  struct buffer **bufs;
+  int nbufs;
+  int followall;
+  int indexall;
+  int wrap;
+  int wrapgen;
+  int hl_defer;
+  struct textRegister reg;
+  long long cachebudget;
   char statusmsg[80];
   time_t statusmsg_time;
-  struct editorSyntax *syntax;
+  int outfd;
+  int sync_output;
+  struct frameQueue out;
   struct termios orig_termios;
 };
 
@@ -106,21 +527,650 @@ char *C_HL_keywords[] = {
 
 struct editorSyntax HLDB[] = {
   {
-    "c",
-    C_HL_extensions,
-    C_HL_keywords,
-    "//", "/*", "*/",
-    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+    .filetype = "c",
+    .filematch = C_HL_extensions,
+    .keywords = C_HL_keywords,
+    .singleline_comment_start = "//",
+    .multiline_comment_start = "/*",
+    .multiline_comment_end = "*/",
+    .string_delimiters = "\"'",
+    .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
   },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+/*** syntax definitions ***/
+
+#define NOTEC_SYNTAX_EXT ".syn"
+#define NOTEC_SYNTAX_CACHE_MAGIC "NSYC"
+#define NOTEC_SYNTAX_CACHE_VERSION 1
+#define NOTEC_SYNTAX_DELIMS " \t\r\n"
+
+struct editorSyntax *SyntaxDB = NULL;
+int SyntaxDBLen = 0;
+
+struct syntaxCacheRecord {
+  char *name;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t size;
+  struct editorSyntax *syntax;
+  int used;
+};
+
+struct syntaxCacheReader {
+  const char *p;
+  const char *end;
+  int ok;
+};
+
+char *editorUserPath(const char *xdgvar, const char *fallback,
+                     const char *leaf) {
+  char *path = NULL;
+  char *xdg = getenv(xdgvar);
+  char *home = getenv("HOME");
+  int r;
+  if (xdg && *xdg) r = asprintf(&path, "%s/notec/%s", xdg, leaf);
+  else if (home && *home)
+    r = asprintf(&path, "%s/%s/notec/%s", home, fallback, leaf);
+  else return NULL;
+  return r == -1 ? NULL : path;
+}
+
+void mkdirParents(const char *path) {
+  char *p = strdup(path);
+  char *slash;
+  for (slash = strchr(p + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    mkdir(p, 0755);
+    *slash = '/';
+  }
+  free(p);
+}
+
+void strlistPush(char ***list, int *len, char *s) {
+  *list = realloc(*list, sizeof(char *) * (*len + 2));
+  (*list)[(*len)++] = s;
+  (*list)[*len] = NULL;
+}
+
+void strlistFree(char **list) {
+  if (list == NULL) return;
+  for (int j = 0; list[j]; j++) free(list[j]);
+  free(list);
+}
+
+int editorKeywordLen(const char *kw) {
+  int klen = strlen(kw);
+  if (klen && kw[klen - 1] == '|') klen--;
+  return klen;
+}
+
+struct hlTrans editorSyntaxStep(int state, int cc, int quote) {
+  struct hlTrans t = { state, HL_NORMAL, 0 };
+  if (state == HS_MLCOMMENT) {
+    t.hl = HL_MLCOMMENT;
+    if (cc & CC_MCE) t.action = HA_MCE;
+    return t;
+  }
+  if (state >= HS_STRING) {
+    int body = HS_STRING + (state - HS_STRING) / 2 * 2;
+    t.hl = HL_STRING;
+    if (state != body) t.next = body;
+    else if (cc & CC_ESC) t.next = body + 1;
+    else if (quote && HS_STRING + (quote - 1) * 2 == body) t.next = HS_SEP;
+    return t;
+  }
+
+  if (cc & CC_SCS) t.action |= HA_SCS;
+  if (cc & CC_MCS) t.action |= HA_MCS;
+  if (quote) {
+    t.hl = HL_STRING;
+    t.next = HS_STRING + (quote - 1) * 2;
+  } else if (((cc & CC_DIGIT) && state != HS_WORD) ||
+             ((cc & CC_DOT) && state == HS_NUMBER)) {
+    t.hl = HL_NUMBER;
+    t.next = HS_NUMBER;
+  } else {
+    if (state == HS_SEP && (cc & CC_KEYWORD)) t.action |= HA_KEYWORD;
+    t.next = (cc & CC_SEP) ? HS_SEP : HS_WORD;
+  }
+  return t;
+}
+
+/* Bytes with the same role share a class, and every state gets a row of
+ * transitions over the classes, so the highlighter does one lookup per
+ * byte and only falls back to string compares where an action is set. */
+void editorSyntaxBuildTransitions(struct editorSyntax *s, int *quote,
+                                  int nquotes) {
+  int key[256];
+  int first[256];
+  s->nclasses = 0;
+  for (int c = 0; c < 256; c++) {
+    int k = s->cclass[c] | quote[c] << 8;
+    int id = 0;
+    while (id < s->nclasses && key[id] != k) id++;
+    if (id == s->nclasses) {
+      key[id] = k;
+      first[id] = c;
+      s->nclasses++;
+    }
+    s->hlclass[c] = id;
+  }
+
+  int nstates = HS_STRING + 2 * nquotes;
+  free(s->trans);
+  s->trans = malloc(sizeof(struct hlTrans) * nstates * s->nclasses);
+  for (int state = 0; state < nstates; state++) {
+    for (int id = 0; id < s->nclasses; id++) {
+      int c = first[id];
+      s->trans[state * s->nclasses + id] =
+        editorSyntaxStep(state, s->cclass[c], quote[c]);
+    }
+  }
+}
+
+void editorSyntaxBuildTables(struct editorSyntax *s) {
+  int n = 0;
+  int c;
+  while (s->keywords[n]) n++;
+  s->nkeywords = n;
+  s->kwlen = malloc(sizeof(int) * (n + 1));
+  s->kwtype = malloc(n + 1);
+  for (int j = 0; j < n; j++) {
+    s->kwlen[j] = editorKeywordLen(s->keywords[j]);
+    s->kwtype[j] = s->keywords[j][s->kwlen[j]] == '|' ? HL_KEYWORD2
+                                                      : HL_KEYWORD1;
+  }
+
+  char *scs = s->singleline_comment_start;
+  char *mcs = s->multiline_comment_start;
+  char *mce = s->multiline_comment_end;
+  s->scs_len = scs ? strlen(scs) : 0;
+  s->mcs_len = mcs ? strlen(mcs) : 0;
+  s->mce_len = mce ? strlen(mce) : 0;
+  if (!s->mcs_len || !s->mce_len) s->mcs_len = s->mce_len = 0;
+
+  for (c = 0; c < 256; c++) {
+    unsigned char cc = 0;
+    if (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c))
+      cc |= CC_SEP;
+    if (s->kwfirst[c] < s->kwfirst[c + 1]) cc |= CC_KEYWORD;
+    if (s->flags & HL_HIGHLIGHT_NUMBERS) {
+      if (isdigit(c)) cc |= CC_DIGIT;
+      if (c == '.') cc |= CC_DOT;
+    }
+    if (c == '\\') cc |= CC_ESC;
+    s->cclass[c] = cc;
+  }
+  if (s->scs_len) s->cclass[(unsigned char)scs[0]] |= CC_SCS;
+  if (s->mcs_len) {
+    s->cclass[(unsigned char)mcs[0]] |= CC_MCS;
+    s->cclass[(unsigned char)mce[0]] |= CC_MCE;
+  }
+
+  int quote[256] = {0};
+  int nquotes = 0;
+  if ((s->flags & HL_HIGHLIGHT_STRINGS) && s->string_delimiters) {
+    for (char *d = s->string_delimiters; *d && nquotes < NOTEC_HL_QUOTES; d++)
+      if (!quote[(unsigned char)*d]) quote[(unsigned char)*d] = ++nquotes;
+  }
+  editorSyntaxBuildTransitions(s, quote, nquotes);
+}
+
+void editorSyntaxCompile(struct editorSyntax *s) {
+  int counts[256] = {0};
+  int fill[256];
+  int n = 0;
+  int j, c;
+
+  for (j = 0; s->keywords[j]; j++) {
+    if (editorKeywordLen(s->keywords[j]) == 0) continue;
+    counts[(unsigned char)s->keywords[j][0]]++;
+    n++;
+  }
+
+  s->kwfirst[0] = 0;
+  for (c = 0; c < 256; c++) s->kwfirst[c + 1] = s->kwfirst[c] + counts[c];
+  memcpy(fill, s->kwfirst, sizeof(fill));
+
+  char **kw = malloc(sizeof(char *) * (n + 1));
+  for (j = 0; s->keywords[j]; j++) {
+    if (editorKeywordLen(s->keywords[j]) == 0) continue;
+    kw[fill[(unsigned char)s->keywords[j][0]]++] = s->keywords[j];
+  }
+  kw[n] = NULL;
+  s->keywords = kw;
+
+  editorSyntaxBuildTables(s);
+}
+
+void editorSyntaxFree(struct editorSyntax *s) {
+  free(s->filetype);
+  strlistFree(s->filematch);
+  strlistFree(s->keywords);
+  free(s->singleline_comment_start);
+  free(s->multiline_comment_start);
+  free(s->multiline_comment_end);
+  free(s->string_delimiters);
+  free(s->kwlen);
+  free(s->kwtype);
+  free(s->trans);
+  free(s);
+}
+
+struct editorSyntax *editorSyntaxParse(FILE *fp) {
+  struct editorSyntax *s = calloc(1, sizeof(*s));
+  char **keywords = NULL;
+  int nmatch = 0, nkeywords = 0;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) != -1) {
+    char *save;
+    char *key = strtok_r(line, NOTEC_SYNTAX_DELIMS, &save);
+    char *arg;
+    if (key == NULL || key[0] == '#') continue;
+
+    if (!strcmp(key, "filetype")) {
+      if ((arg = strtok_r(NULL, NOTEC_SYNTAX_DELIMS, &save))) {
+        free(s->filetype);
+        s->filetype = strdup(arg);
+      }
+    } else if (!strcmp(key, "match")) {
+      while ((arg = strtok_r(NULL, NOTEC_SYNTAX_DELIMS, &save)))
+        strlistPush(&s->filematch, &nmatch, strdup(arg));
+    } else if (!strcmp(key, "keywords") || !strcmp(key, "types")) {
+      int kw2 = (key[0] == 't');
+      while ((arg = strtok_r(NULL, NOTEC_SYNTAX_DELIMS, &save))) {
+        int len = strlen(arg);
+        char *kw = malloc(len + 2);
+        memcpy(kw, arg, len);
+        if (kw2) kw[len++] = '|';
+        kw[len] = '\0';
+        strlistPush(&keywords, &nkeywords, kw);
+      }
+    } else if (!strcmp(key, "comment")) {
+      if ((arg = strtok_r(NULL, NOTEC_SYNTAX_DELIMS, &save))) {
+        free(s->singleline_comment_start);
+        s->singleline_comment_start = strdup(arg);
+      }
+    } else if (!strcmp(key, "multiline")) {
+      char *end;
+      if ((arg = strtok_r(NULL, NOTEC_SYNTAX_DELIMS, &save)) &&
+          (end = strtok_r(NULL, NOTEC_SYNTAX_DELIMS, &save))) {
+        free(s->multiline_comment_start);
+        free(s->multiline_comment_end);
+        s->multiline_comment_start = strdup(arg);
+        s->multiline_comment_end = strdup(end);
+      }
+    } else if (!strcmp(key, "strings")) {
+      if ((arg = strtok_r(NULL, NOTEC_SYNTAX_DELIMS, &save))) {
+        free(s->string_delimiters);
+        s->string_delimiters = strdup(arg);
+        s->flags |= HL_HIGHLIGHT_STRINGS;
+      }
+    } else if (!strcmp(key, "numbers")) {
+      if ((arg = strtok_r(NULL, NOTEC_SYNTAX_DELIMS, &save)) &&
+          (!strcmp(arg, "on") || !strcmp(arg, "yes")))
+        s->flags |= HL_HIGHLIGHT_NUMBERS;
+    }
+  }
+  free(line);
+
+  if (s->filematch == NULL) s->filematch = calloc(1, sizeof(char *));
+  if (keywords == NULL) keywords = calloc(1, sizeof(char *));
+  s->keywords = keywords;
+  editorSyntaxCompile(s);
+  free(keywords);
+
+  if (s->filetype == NULL) {
+    editorSyntaxFree(s);
+    return NULL;
+  }
+  return s;
+}
+
+void syntaxCacheWriteU32(FILE *fp, uint32_t v) {
+  fwrite(&v, sizeof(v), 1, fp);
+}
+
+void syntaxCacheWriteI64(FILE *fp, int64_t v) {
+  fwrite(&v, sizeof(v), 1, fp);
+}
+
+void syntaxCacheWriteStr(FILE *fp, const char *s) {
+  if (s == NULL) {
+    syntaxCacheWriteU32(fp, UINT32_MAX);
+    return;
+  }
+  uint32_t len = strlen(s);
+  syntaxCacheWriteU32(fp, len);
+  fwrite(s, 1, len, fp);
+}
+
+void syntaxCacheWriteList(FILE *fp, char **list) {
+  uint32_t n = 0;
+  while (list[n]) n++;
+  syntaxCacheWriteU32(fp, n);
+  for (uint32_t j = 0; j < n; j++) syntaxCacheWriteStr(fp, list[j]);
+}
+
+uint32_t syntaxCacheReadU32(struct syntaxCacheReader *r) {
+  uint32_t v = 0;
+  if (!r->ok || r->end - r->p < (long)sizeof(v)) {
+    r->ok = 0;
+    return 0;
+  }
+  memcpy(&v, r->p, sizeof(v));
+  r->p += sizeof(v);
+  return v;
+}
+
+int64_t syntaxCacheReadI64(struct syntaxCacheReader *r) {
+  int64_t v = 0;
+  if (!r->ok || r->end - r->p < (long)sizeof(v)) {
+    r->ok = 0;
+    return 0;
+  }
+  memcpy(&v, r->p, sizeof(v));
+  r->p += sizeof(v);
+  return v;
+}
+
+char *syntaxCacheReadStr(struct syntaxCacheReader *r) {
+  uint32_t len = syntaxCacheReadU32(r);
+  if (!r->ok || len == UINT32_MAX) return NULL;
+  if ((uint32_t)(r->end - r->p) < len) {
+    r->ok = 0;
+    return NULL;
+  }
+  char *s = malloc(len + 1);
+  memcpy(s, r->p, len);
+  s[len] = '\0';
+  r->p += len;
+  return s;
+}
+
+char **syntaxCacheReadList(struct syntaxCacheReader *r) {
+  uint32_t n = syntaxCacheReadU32(r);
+  if (!r->ok || n > (uint32_t)(r->end - r->p) / sizeof(uint32_t)) {
+    r->ok = 0;
+    return NULL;
+  }
+  char **list = calloc(n + 1, sizeof(char *));
+  for (uint32_t j = 0; j < n && r->ok; j++) {
+    list[j] = syntaxCacheReadStr(r);
+    if (list[j] == NULL) r->ok = 0;
+  }
+  return list;
+}
+
+void syntaxCacheWriteSyntax(FILE *fp, struct editorSyntax *s) {
+  syntaxCacheWriteStr(fp, s->filetype);
+  syntaxCacheWriteList(fp, s->filematch);
+  syntaxCacheWriteList(fp, s->keywords);
+  for (int c = 0; c < 257; c++) syntaxCacheWriteU32(fp, s->kwfirst[c]);
+  syntaxCacheWriteStr(fp, s->singleline_comment_start);
+  syntaxCacheWriteStr(fp, s->multiline_comment_start);
+  syntaxCacheWriteStr(fp, s->multiline_comment_end);
+  syntaxCacheWriteStr(fp, s->string_delimiters);
+  syntaxCacheWriteU32(fp, s->flags);
+}
+
+struct editorSyntax *syntaxCacheReadSyntax(struct syntaxCacheReader *r) {
+  struct editorSyntax *s = calloc(1, sizeof(*s));
+  s->filetype = syntaxCacheReadStr(r);
+  s->filematch = syntaxCacheReadList(r);
+  s->keywords = syntaxCacheReadList(r);
+  for (int c = 0; c < 257; c++) s->kwfirst[c] = syntaxCacheReadU32(r);
+  s->singleline_comment_start = syntaxCacheReadStr(r);
+  s->multiline_comment_start = syntaxCacheReadStr(r);
+  s->multiline_comment_end = syntaxCacheReadStr(r);
+  s->string_delimiters = syntaxCacheReadStr(r);
+  s->flags = syntaxCacheReadU32(r);
+
+  if (r->ok && s->filetype && s->filematch && s->keywords) {
+    editorSyntaxBuildTables(s);
+    int valid = (s->kwfirst[0] == 0 && s->kwfirst[256] == s->nkeywords);
+    for (int c = 0; c < 256 && valid; c++)
+      if (s->kwfirst[c] > s->kwfirst[c + 1]) valid = 0;
+    if (valid) return s;
+  }
+  r->ok = 0;
+  editorSyntaxFree(s);
+  return NULL;
+}
+
+int syntaxCacheLoad(const char *path, struct syntaxCacheRecord **records) {
+  *records = NULL;
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return 0;
+
+  struct stat st;
+  char *buf = NULL;
+  if (fstat(fileno(fp), &st) == 0 && st.st_size > 0) {
+    buf = malloc(st.st_size);
+    if (fread(buf, 1, st.st_size, fp) != (size_t)st.st_size) {
+      free(buf);
+      buf = NULL;
+    }
+  }
+  fclose(fp);
+  if (buf == NULL) return 0;
+
+  struct syntaxCacheReader r = { buf, buf + st.st_size, 1 };
+  int n = 0;
+  if (st.st_size < 4 || memcmp(buf, NOTEC_SYNTAX_CACHE_MAGIC, 4)) r.ok = 0;
+  r.p += 4;
+  if (syntaxCacheReadU32(&r) != NOTEC_SYNTAX_CACHE_VERSION) r.ok = 0;
+  uint32_t count = syntaxCacheReadU32(&r);
+
+  for (uint32_t j = 0; j < count && r.ok; j++) {
+    struct syntaxCacheRecord rec;
+    rec.name = syntaxCacheReadStr(&r);
+    rec.mtime_sec = syntaxCacheReadI64(&r);
+    rec.mtime_nsec = syntaxCacheReadI64(&r);
+    rec.size = syntaxCacheReadI64(&r);
+    rec.syntax = r.ok ? syntaxCacheReadSyntax(&r) : NULL;
+    rec.used = 0;
+    if (rec.name == NULL || rec.syntax == NULL) {
+      free(rec.name);
+      break;
+    }
+    *records = realloc(*records, sizeof(rec) * (n + 1));
+    (*records)[n++] = rec;
+  }
+
+  free(buf);
+  return n;
+}
+
+void syntaxCacheSave(const char *path, struct syntaxCacheRecord *records,
+                     int n) {
+  char *tmp;
+  if (asprintf(&tmp, "%s.%d", path, (int)getpid()) == -1) return;
+  mkdirParents(path);
+
+  FILE *fp = fopen(tmp, "wb");
+  if (fp) {
+    fwrite(NOTEC_SYNTAX_CACHE_MAGIC, 1, 4, fp);
+    syntaxCacheWriteU32(fp, NOTEC_SYNTAX_CACHE_VERSION);
+    syntaxCacheWriteU32(fp, n);
+    for (int j = 0; j < n; j++) {
+      syntaxCacheWriteStr(fp, records[j].name);
+      syntaxCacheWriteI64(fp, records[j].mtime_sec);
+      syntaxCacheWriteI64(fp, records[j].mtime_nsec);
+      syntaxCacheWriteI64(fp, records[j].size);
+      syntaxCacheWriteSyntax(fp, records[j].syntax);
+    }
+    if (fclose(fp) == 0 && rename(tmp, path) == 0) {
+      free(tmp);
+      return;
+    }
+  }
+  unlink(tmp);
+  free(tmp);
+}
+
+int syntaxNameCmp(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int editorLoadSyntaxDir(struct syntaxCacheRecord **loaded) {
+  char *dir = getenv("NOTEC_SYNTAX_DIR");
+  dir = (dir && *dir) ? strdup(dir)
+                      : editorUserPath("XDG_CONFIG_HOME", ".config", "syntax");
+  *loaded = NULL;
+  if (dir == NULL) return 0;
+
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    free(dir);
+    return 0;
+  }
+
+  char **names = NULL;
+  int nnames = 0;
+  struct dirent *de;
+  int extlen = strlen(NOTEC_SYNTAX_EXT);
+  while ((de = readdir(d)) != NULL) {
+    int len = strlen(de->d_name);
+    if (len > extlen && !strcmp(&de->d_name[len - extlen], NOTEC_SYNTAX_EXT))
+      strlistPush(&names, &nnames, strdup(de->d_name));
+  }
+  closedir(d);
+  if (nnames) qsort(names, nnames, sizeof(char *), syntaxNameCmp);
+
+  char *cachepath = editorUserPath("XDG_CACHE_HOME", ".cache", "syntax.cache");
+  struct syntaxCacheRecord *cached = NULL;
+  int ncached = cachepath ? syntaxCacheLoad(cachepath, &cached) : 0;
+  int stale = 0;
+  int n = 0;
+
+  for (int j = 0; j < nnames; j++) {
+    char *path;
+    struct stat st;
+    if (asprintf(&path, "%s/%s", dir, names[j]) == -1) continue;
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+      free(path);
+      continue;
+    }
+
+    struct syntaxCacheRecord rec = {
+      names[j], st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size, NULL, 1
+    };
+    for (int k = 0; k < ncached; k++) {
+      if (!cached[k].used && !strcmp(cached[k].name, rec.name) &&
+          cached[k].mtime_sec == rec.mtime_sec &&
+          cached[k].mtime_nsec == rec.mtime_nsec &&
+          cached[k].size == rec.size) {
+        cached[k].used = 1;
+        rec.syntax = cached[k].syntax;
+        break;
+      }
+    }
+    if (rec.syntax == NULL) {
+      FILE *fp = fopen(path, "r");
+      if (fp) {
+        rec.syntax = editorSyntaxParse(fp);
+        fclose(fp);
+      }
+      stale = 1;
+    }
+    free(path);
+
+    if (rec.syntax == NULL) continue;
+    names[j] = NULL;
+    *loaded = realloc(*loaded, sizeof(rec) * (n + 1));
+    (*loaded)[n++] = rec;
+  }
+
+  for (int k = 0; k < ncached; k++) {
+    if (!cached[k].used) {
+      stale = 1;
+      editorSyntaxFree(cached[k].syntax);
+    }
+    free(cached[k].name);
+  }
+  free(cached);
+
+  if (stale && cachepath) syntaxCacheSave(cachepath, *loaded, n);
+
+  for (int j = 0; j < nnames; j++) free(names[j]);
+  free(names);
+  free(cachepath);
+  free(dir);
+  return n;
+}
+
+void editorInitSyntaxDB() {
+  struct syntaxCacheRecord *loaded;
+  int n = editorLoadSyntaxDir(&loaded);
+
+  SyntaxDBLen = n + HLDB_ENTRIES;
+  SyntaxDB = malloc(sizeof(struct editorSyntax) * SyntaxDBLen);
+
+  for (int j = 0; j < n; j++) {
+    SyntaxDB[j] = *loaded[j].syntax;
+    free(loaded[j].syntax);
+    free(loaded[j].name);
+  }
+  free(loaded);
+
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    SyntaxDB[n + j] = HLDB[j];
+    editorSyntaxCompile(&SyntaxDB[n + j]);
+  }
+}
+
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
+void editorWaitForInput();
+long long editorNowMs();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorConfirm(const char *fmt, ...);
+void editorDiskSnapshot(int from);
+int editorDiskUnchanged();
+int editorModified();
+struct codec *editorFileCodec(const char *filename);
+int editorFileIsBinary(const char *filename);
+char *editorSidecarPath(const char *filename, const char *suffix);
+void editorJournalInsert(int at, char *s, int len);
+void editorJournalDelete(int at);
+void editorJournalRow(int at);
+void editorJournalFlush();
+void editorJournalReset();
+void editorIndexInsertRows(int at, int n);
+void editorIndexDeleteRows(int at, int n);
+void editorIndexRowUpdated(erow *row);
+void editorIndexSave();
+void editorFilterInsertRows(int at, int n);
+void editorBracketRowUpdated(erow *row);
+void editorBracketInsertRows(int at, int n);
+void editorBracketDeleteRows(int at, int n);
+void editorFoldInsertRows(int at, int n);
+void editorFoldDeleteRows(int at, int n);
+void editorUndoInsertRows(int at, int n);
+void editorUndoDeleteRows(int at, int n);
+int editorFoldHidden(int filerow);
+void editorFilterDeleteRows(int at, int n);
+void editorFilterRowUpdated(erow *row);
+void editorSelectionBounds(int *y0, int *x0, int *y1, int *x1);
+void editorPagerRefresh();
+void editorPagerProcessKeypress();
+void editorHexRefresh();
+void editorHexProcessKeypress();
+void editorLayout();
+void editorRenderRow(erow *row);
+void editorCacheCharge(erow *row);
+void editorCacheRemove(erow *row);
+void editorCacheShift(int from, int delta);
+void editorRowEnsure(erow *row);
+int *editorRowMap(erow *row);
 
 /*** terminal ***/
 
@@ -155,8 +1205,10 @@ void enableRawMode() {
 int editorReadKey() {
   int nread;
   char c;
+  editorWaitForInput();
   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
     if (nread == -1 && errno != EAGAIN) die("read");
+    editorWaitForInput();
   }
 
   if (c == '\x1b') {
@@ -198,7 +1250,7 @@ int editorReadKey() {
 
     return '\x1b';
   } else {
-    return c;
+    return (unsigned char)c;
   }
 }
 
@@ -221,6 +1273,34 @@ int getCursorPosition(int *rows, int *cols) {
   return 0;
 }
 
+int editorQuerySyncOutput() {
+  const char *query = "\x1b[?2026$p\x1b[c";
+  char buf[256];
+  unsigned int i = 0;
+
+  if (write(STDOUT_FILENO, query, strlen(query)) != (ssize_t)strlen(query))
+    return 0;
+
+  while (i < sizeof(buf) - 1) {
+    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+    if (buf[i] == 'c') break;
+    i++;
+  }
+  buf[i] = '\0';
+
+  return strstr(buf, "\x1b[?2026;1$y") || strstr(buf, "\x1b[?2026;2$y");
+}
+
+void editorOpenOutput() {
+  E.outfd = STDOUT_FILENO;
+  char *tty = isatty(STDOUT_FILENO) ? ttyname(STDOUT_FILENO) : NULL;
+  if (tty) {
+    int fd = open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd != -1) E.outfd = fd;
+  }
+  E.sync_output = editorQuerySyncOutput();
+}
+
 int getWindowSize(int *rows, int *cols) {
   struct winsize ws;
 
@@ -236,123 +1316,88 @@ int getWindowSize(int *rows, int *cols) {
 
 /*** syntax highlighting ***/
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int editorSyntaxKeyword(struct editorSyntax *s, const unsigned char *p) {
+  for (int j = s->kwfirst[p[0]]; j < s->kwfirst[p[0] + 1]; j++) {
+    int klen = s->kwlen[j];
+    if (!strncmp((const char *)p, s->keywords[j], klen) &&
+        (s->cclass[p[klen]] & CC_SEP)) return j;
+  }
+  return -1;
 }
 
-void editorUpdateSyntax(erow *row) {
+int editorHighlightRow(erow *row) {
+  if (row->render == NULL) editorRenderRow(row);
   row->hl = realloc(row->hl, row->rsize);
   memset(row->hl, HL_NORMAL, row->rsize);
+  editorCacheCharge(row);
 
-  if (E.syntax == NULL) return;
-
-  char **keywords = E.syntax->keywords;
+  if (E.cur->syntax == NULL) {
+    editorBracketRowUpdated(row);
+    return 0;
+  }
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+  struct editorSyntax *s = E.cur->syntax;
+  const unsigned char *hlclass = s->hlclass;
+  const struct hlTrans *trans = s->trans;
+  int nclasses = s->nclasses;
+  const unsigned char *r = (const unsigned char *)row->render;
+  unsigned char *hl = row->hl;
+  int rsize = row->rsize;
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
-
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+  int state = (row->idx > 0 && E.cur->row[row->idx - 1].hl_open_comment)
+                ? HS_MLCOMMENT : HS_SEP;
 
   int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
-
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
+  while (i < rsize) {
+    const struct hlTrans *t = &trans[state * nclasses + hlclass[r[i]]];
+    if (t->action) {
+      const char *p = (const char *)&r[i];
+      if ((t->action & HA_MCE) &&
+          !strncmp(p, s->multiline_comment_end, s->mce_len)) {
+        memset(&hl[i], HL_MLCOMMENT, s->mce_len);
+        i += s->mce_len;
+        state = HS_SEP;
         continue;
       }
-    }
-
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
-        if (c == in_string) in_string = 0;
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
+      if ((t->action & HA_SCS) &&
+          !strncmp(p, s->singleline_comment_start, s->scs_len)) {
+        memset(&hl[i], HL_COMMENT, rsize - i);
+        break;
       }
-    }
-
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0;
+      if ((t->action & HA_MCS) &&
+          !strncmp(p, s->multiline_comment_start, s->mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, s->mcs_len);
+        i += s->mcs_len;
+        state = HS_MLCOMMENT;
         continue;
       }
-    }
-
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
+      int kw = (t->action & HA_KEYWORD) ? editorSyntaxKeyword(s, &r[i]) : -1;
+      if (kw != -1) {
+        memset(&hl[i], s->kwtype[kw], s->kwlen[kw]);
+        i += s->kwlen[kw];
+        state = HS_WORD;
         continue;
       }
     }
-
-    prev_sep = is_separator(c);
-    i++;
+    hl[i++] = t->hl;
+    state = t->next;
   }
 
+  int in_comment = state == HS_MLCOMMENT;
   int changed = (row->hl_open_comment != in_comment);
   row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  editorBracketRowUpdated(row);
+  return changed;
+}
+
+void editorUpdateSyntax(erow *row) {
+  while (editorHighlightRow(row) && row->idx + 1 < E.cur->numrows)
+    row = &E.cur->row[row->idx + 1];
+}
+
+void editorUpdateSyntaxRange(int first, int last) {
+  for (int j = first; j < last; j++) editorHighlightRow(&E.cur->row[j]);
+  editorUpdateSyntax(&E.cur->row[last]);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -364,28 +1409,54 @@ int editorSyntaxToColor(int hl) {
     case HL_STRING: return 35;
     case HL_NUMBER: return 31;
     case HL_MATCH: return 34;
+    case HL_DIFF_ADD: return 32;
+    case HL_DIFF_CHANGE: return 33;
+    case HL_DIFF_DELETE: return 31;
     default: return 37;
   }
 }
 
-void editorSelectSyntaxHighlight() {
-  E.syntax = NULL;
-  if (E.filename == NULL) return;
+struct hlEscape {
+  int color;
+  int len;
+  char seq[8];
+};
 
-  char *ext = strrchr(E.filename, '.');
+struct hlEscape HLEscapes[256];
 
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
+void editorInitHighlightEscapes() {
+  for (int hl = 0; hl < 256; hl++) {
+    struct hlEscape *esc = &HLEscapes[hl];
+    esc->color = (hl == HL_NORMAL) ? 39 : editorSyntaxToColor(hl);
+    esc->len = snprintf(esc->seq, sizeof(esc->seq), "\x1b[%dm", esc->color);
+  }
+}
+
+void editorSelectSyntaxHighlight() {
+  E.cur->syntax = NULL;
+  if (E.cur->filename == NULL) return;
+
+  struct codec *codec = editorFileCodec(E.cur->filename);
+  size_t len = strlen(E.cur->filename);
+  if (codec) len -= strlen(codec->suffix);
+  char *ext = NULL;
+  for (size_t k = 0; k < len; k++)
+    if (E.cur->filename[k] == '.') ext = &E.cur->filename[k];
+  size_t extlen = ext ? (size_t)(&E.cur->filename[len] - ext) : 0;
+
+  for (int j = 0; j < SyntaxDBLen; j++) {
+    struct editorSyntax *s = &SyntaxDB[j];
     unsigned int i = 0;
     while (s->filematch[i]) {
       int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        E.syntax = s;
+      if ((is_ext && ext && strlen(s->filematch[i]) == extlen &&
+           !strncmp(ext, s->filematch[i], extlen)) ||
+          (!is_ext && strstr(E.cur->filename, s->filematch[i]))) {
+        E.cur->syntax = s;
 
         int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          editorUpdateSyntax(&E.row[filerow]);
+        for (filerow = 0; filerow < E.cur->numrows; filerow++) {
+          editorUpdateSyntax(&E.cur->row[filerow]);
         }
 
         return;
@@ -395,129 +1466,763 @@ void editorSelectSyntaxHighlight() {
   }
 }
 
+/*** unicode ***/
+
+struct cpRange {
+  int first;
+  int last;
+};
+
+struct cpRange ZeroWidthRanges[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+  {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+  {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+  {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902}, {0x093A, 0x093A},
+  {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+  {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF},
+  {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+  {0x20D0, 0x20FF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xFE00, 0xFE0F},
+  {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0x1F3FB, 0x1F3FF}, {0xE0001, 0xE0001},
+  {0xE0020, 0xE007F}, {0xE0100, 0xE01EF},
+};
+
+struct cpRange WideRanges[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+  {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+  {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+  {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+  {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+  {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+  {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+  {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+  {0x3041, 0x3096}, {0x309B, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF},
+  {0xA000, 0xA4CF}, {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+  {0xFE10, 0xFE19}, {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6},
+  {0x16FE0, 0x16FE4}, {0x17000, 0x18AFF}, {0x1B000, 0x1B16F},
+  {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E},
+  {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F320},
+  {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393},
+  {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0},
+  {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F3FA}, {0x1F400, 0x1F43E},
+  {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D},
+  {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A},
+  {0x1F595, 0x1F596}, {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F},
+  {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC}, {0x1F6D0, 0x1F6D2},
+  {0x1F6D5, 0x1F6D7}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC},
+  {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945},
+  {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+  {0x30000, 0x3FFFD},
+};
+
+#define CP_RANGES(r) ((int)(sizeof(r) / sizeof(r[0])))
+
+int cpInRanges(int cp, struct cpRange *r, int n) {
+  int lo = 0, hi = n - 1;
+  if (cp < r[0].first || cp > r[hi].last) return 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp > r[mid].last) lo = mid + 1;
+    else if (cp < r[mid].first) hi = mid - 1;
+    else return 1;
+  }
+  return 0;
+}
+
+int utf8Decode(const char *s, int len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n, c;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+    n = 2;
+    c = u[0] & 0x1F;
+  } else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+    n = 3;
+    c = u[0] & 0x0F;
+  } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+    n = 4;
+    c = u[0] & 0x07;
+  } else {
+    *cp = -1;
+    return 1;
+  }
+  if (len < n) {
+    *cp = -1;
+    return 1;
+  }
+  for (int j = 1; j < n; j++) {
+    if ((u[j] & 0xC0) != 0x80) {
+      *cp = -1;
+      return 1;
+    }
+    c = (c << 6) | (u[j] & 0x3F);
+  }
+  if ((n == 3 && (c < 0x800 || (c >= 0xD800 && c <= 0xDFFF))) ||
+      (n == 4 && (c < 0x10000 || c > 0x10FFFF))) {
+    *cp = -1;
+    return 1;
+  }
+  *cp = c;
+  return n;
+}
+
+int utf8IsSymbol(int cp) {
+  return cp < 0 || cp < 0x20 || (cp >= 0x7F && cp < 0xA0);
+}
+
+int utf8Width(int cp) {
+  if (utf8IsSymbol(cp)) return 1;
+  if (cp < 0x300) return 1;
+  if (cpInRanges(cp, ZeroWidthRanges, CP_RANGES(ZeroWidthRanges))) return 0;
+  if (cpInRanges(cp, WideRanges, CP_RANGES(WideRanges))) return 2;
+  return 1;
+}
+
+/*** fenwick tree ***/
+
+void fenwickBuild(struct fenwick *f, int n, long long (*value)(int)) {
+  if (n + 1 > f->cap) {
+    f->cap = n + 1;
+    f->tree = realloc(f->tree, sizeof(long long) * f->cap);
+  }
+  f->n = n;
+  f->stale = 0;
+  f->tree[0] = 0;
+  for (int i = 1; i <= n; i++) f->tree[i] = value(i - 1);
+  for (int i = 1; i <= n; i++) {
+    int parent = i + (i & -i);
+    if (parent <= n) f->tree[parent] += f->tree[i];
+  }
+}
+
+void fenwickAdd(struct fenwick *f, int i, long long delta) {
+  for (i++; i <= f->n; i += i & -i) f->tree[i] += delta;
+}
+
+long long fenwickPrefix(struct fenwick *f, int i) {
+  long long sum = 0;
+  if (i > f->n) i = f->n;
+  for (; i > 0; i -= i & -i) sum += f->tree[i];
+  return sum;
+}
+
+void fenwickAppend(struct fenwick *f, long long value) {
+  if (f->n + 2 > f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 64;
+    f->tree = realloc(f->tree, sizeof(long long) * f->cap);
+  }
+  int i = ++f->n;
+  f->tree[i] = value + fenwickPrefix(f, i - 1) - fenwickPrefix(f, i - (i & -i));
+}
+
+int fenwickFind(struct fenwick *f, long long *offset) {
+  int pos = 0;
+  int step = 1;
+  while (step * 2 <= f->n) step *= 2;
+  for (; step; step /= 2) {
+    if (pos + step <= f->n && f->tree[pos + step] <= *offset) {
+      pos += step;
+      *offset -= f->tree[pos];
+    }
+  }
+  return pos;
+}
+
+/*** hashing ***/
+
+uint64_t editorHash(const char *s, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+  uint64_t k;
+  while (len >= 8) {
+    memcpy(&k, s, 8);
+    h = (h ^ k) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+    s += 8;
+    len -= 8;
+  }
+  k = 0;
+  memcpy(&k, s, len);
+  h = (h ^ k) * 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+uint64_t editorRowHash(erow *row) {
+  return editorHash(row->chars, row->size);
+}
+
 /*** row operations ***/
 
 int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (NOTEC_TAB_STOP - 1) - (rx % NOTEC_TAB_STOP);
-    rx++;
+  int *map = editorRowMap(row);
+  return map ? map[cx] : cx;
+}
+
+int editorRowCxToRi(erow *row, int cx) {
+  int *map = editorRowMap(row);
+  return map ? map[row->size + 1 + cx] : cx;
+}
+
+int editorRowMapSearch(erow *row, int *map, int value) {
+  int lo = 0, hi = row->size;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (map[mid] <= value) lo = mid;
+    else hi = mid - 1;
   }
-  return rx;
+  while (lo > 0 && map[lo - 1] == map[lo]) lo--;
+  return lo;
 }
 
 int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      cur_rx += (NOTEC_TAB_STOP - 1) - (cur_rx % NOTEC_TAB_STOP);
-    cur_rx++;
+  int *map = editorRowMap(row);
+  if (map == NULL) return rx < row->size ? rx : row->size;
+  return editorRowMapSearch(row, map, rx);
+}
+
+int editorRowRiToCx(erow *row, int ri) {
+  int *map = editorRowMap(row);
+  if (map == NULL) return ri < row->size ? ri : row->size;
+  return editorRowMapSearch(row, &map[row->size + 1], ri);
+}
 
-    if (cur_rx > rx) return cx;
+int editorRowCharStart(erow *row, int cx) {
+  if (cx <= 0 || cx >= row->size) return cx;
+  int j = cx;
+  while (j > 0 && cx - j < 3 && ((unsigned char)row->chars[j] & 0xC0) == 0x80)
+    j--;
+  int cp;
+  if (j < cx && j + utf8Decode(&row->chars[j], row->size - j, &cp) > cx)
+    return j;
+  return cx;
+}
+
+int editorRowNextChar(erow *row, int cx) {
+  int cp;
+  if (cx >= row->size) return row->size;
+  cx += utf8Decode(&row->chars[cx], row->size - cx, &cp);
+  while (cx < row->size && (unsigned char)row->chars[cx] >= 0x80) {
+    int n = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+    if (utf8Width(cp) != 0) break;
+    cx += n;
   }
   return cx;
 }
 
-void editorUpdateRow(erow *row) {
+int editorRowPrevChar(erow *row, int cx) {
+  int cp;
+  while (cx > 0) {
+    cx = editorRowCharStart(row, cx - 1);
+    utf8Decode(&row->chars[cx], row->size - cx, &cp);
+    if (utf8Width(cp) != 0) break;
+  }
+  return cx;
+}
+
+int editorRowWrapBreak(erow *row, int col) {
+  int limit = col + E.wrapcols;
+  int cx = editorRowRxToCx(row, limit);
+  int start = editorRowCxToRx(row, cx);
+  if (start > col && start < limit && row->chars[cx] != '\t') return start;
+  return limit;
+}
+
+int editorRowWrapLines(erow *row) {
+  if (!row->needmap) return row->rwidth / E.wrapcols + 1;
+  int lines = 1;
+  int col = 0;
+  while (row->rwidth - col >= E.wrapcols) {
+    col = editorRowWrapBreak(row, col);
+    lines++;
+  }
+  return lines;
+}
+
+int editorRowWrapStart(erow *row, int seg) {
+  if (!row->needmap) return seg * E.wrapcols;
+  int col = 0;
+  while (seg-- > 0) col = editorRowWrapBreak(row, col);
+  return col;
+}
+
+int editorRowWrapSegment(erow *row, int rx, int *start) {
+  int seg = 0;
+  int col = 0;
+  if (!row->needmap) {
+    seg = rx / E.wrapcols;
+    col = seg * E.wrapcols;
+  } else {
+    while (row->rwidth - col >= E.wrapcols) {
+      int next = editorRowWrapBreak(row, col);
+      if (rx < next) break;
+      col = next;
+      seg++;
+    }
+  }
+  if (start) *start = col;
+  return seg;
+}
+
+void editorWrapRowUpdated(erow *row) {
+  int lines = editorRowWrapLines(row);
+  if (!E.cur->vindex.stale && row->idx < E.cur->vindex.n &&
+      !editorFoldHidden(row->idx))
+    fenwickAdd(&E.cur->vindex, row->idx, lines - row->vlines);
+  row->vlines = lines;
+}
+
+/* Expands tabs into render and fills the column maps; any of render, rx/ri
+ * and width may be NULL. It touches no row, so filter workers can use it. */
+int editorExpandChars(const char *chars, int size, char *render, int *rx,
+                      int *ri, int *width) {
+  int idx = 0;
+  int col = 0;
+  int j = 0;
+  while (j < size) {
+    if (chars[j] == '\t') {
+      if (rx) {
+        rx[j] = col;
+        ri[j] = idx;
+      }
+      int next = (col / NOTEC_TAB_STOP + 1) * NOTEC_TAB_STOP;
+      if (render) memset(&render[idx], ' ', next - col);
+      idx += next - col;
+      col = next;
+      j++;
+      continue;
+    }
+
+    int cp;
+    int n = utf8Decode(&chars[j], size - j, &cp);
+    for (int k = 0; k < n; k++) {
+      if (rx) {
+        rx[j + k] = col;
+        ri[j + k] = idx;
+      }
+      if (render) render[idx] = chars[j + k];
+      idx++;
+    }
+    col += utf8Width(cp);
+    j += n;
+  }
+  if (rx) {
+    rx[size] = col;
+    ri[size] = idx;
+  }
+  if (render) render[idx] = '\0';
+  if (width) *width = col;
+  return idx;
+}
+
+void editorRowExpand(erow *row, char *render, int *rx, int *ri) {
+  row->rsize = editorExpandChars(row->chars, row->size, render, rx, ri,
+                                 &row->rwidth);
+}
+
+void editorUpdateRenderMap(erow *row) {
+  row->cxmap = realloc(row->cxmap, sizeof(int) * 2 * (row->size + 1));
+  editorRowExpand(row, row->render, row->cxmap, &row->cxmap[row->size + 1]);
+}
+
+void editorRenderRow(erow *row) {
   int tabs = 0;
+  int multibyte = 0;
   int j;
-  for (j = 0; j < row->size; j++)
+  for (j = 0; j < row->size; j++) {
     if (row->chars[j] == '\t') tabs++;
+    else if ((unsigned char)row->chars[j] >= 0x80) multibyte = 1;
+  }
 
   free(row->render);
   row->render = malloc(row->size + tabs*(NOTEC_TAB_STOP - 1) + 1);
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % NOTEC_TAB_STOP != 0) row->render[idx++] = ' ';
-    } else {
-      row->render[idx++] = row->chars[j];
-    }
+  row->needmap = tabs || multibyte;
+  if (!row->needmap) {
+    free(row->cxmap);
+    row->cxmap = NULL;
+    memcpy(row->render, row->chars, row->size);
+    row->render[row->size] = '\0';
+    row->rsize = row->size;
+    row->rwidth = row->size;
+  } else {
+    editorUpdateRenderMap(row);
+  }
+  editorCacheCharge(row);
+}
+
+void editorUpdateRow(erow *row) {
+  editorRenderRow(row);
+  uint64_t hash = editorRowHash(row);
+  E.cur->digest += hash - row->hash;
+  row->hash = hash;
+  E.cur->diff.stale = 1;
+  if (E.wrap) editorWrapRowUpdated(row);
+  if (!E.cur->bindex.stale && row->idx < E.cur->bindex.n) {
+    long long old = fenwickPrefix(&E.cur->bindex, row->idx + 1) -
+                    fenwickPrefix(&E.cur->bindex, row->idx);
+    fenwickAdd(&E.cur->bindex, row->idx, row->size + 1 - old);
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  if (E.cur->index.enabled) editorIndexRowUpdated(row);
+  if (E.cur->filter.active) editorFilterRowUpdated(row);
+  if (!E.hl_defer) editorUpdateSyntax(row);
+}
 
-  editorUpdateSyntax(row);
+void editorReserveRows(int n) {
+  if (n <= E.cur->rowcap) return;
+  while (E.cur->rowcap < n)
+    E.cur->rowcap = E.cur->rowcap ? E.cur->rowcap * 2 : 64;
+  E.cur->row = realloc(E.cur->row, sizeof(erow) * E.cur->rowcap);
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
+void editorTextRelease(struct textBuf *buf) {
+  if (--buf->refs > 0) return;
+  free(buf->data);
+  free(buf);
+}
+
+/* A shared row points into a refcounted clipboard chunk and gets its own
+ * copy of the text before the first edit. */
+void editorRowUnshare(erow *row) {
+  if (row->shared == NULL) return;
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size + 1);
+  editorTextRelease(row->shared);
+  row->chars = chars;
+  row->shared = NULL;
+}
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+void editorInitRow(erow *row, int at, char *s, size_t len,
+                   struct textBuf *shared) {
+  row->idx = at;
 
-  E.row[at].idx = at;
+  row->size = len;
+  row->shared = shared;
+  if (shared) {
+    shared->refs++;
+    row->chars = s;
+  } else {
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+  }
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  row->rsize = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_open_comment = 0;
+  row->cxmap = NULL;
+  row->needmap = 0;
+  row->vlines = 1;
+  row->hash = 0;
+  row->cached = 0;
+  row->slot = -1;
+  row->ref = 0;
+  memset(&row->br, 0, sizeof(row->br));
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.cur->numrows) return;
+  editorJournalFlush();
+  int append = (at == E.cur->numrows);
+  if (!append) {
+    E.cur->vindex.stale = 1;
+    E.cur->bindex.stale = 1;
+  }
 
-  E.numrows++;
-  E.dirty++;
+  editorReserveRows(E.cur->numrows + 1);
+  memmove(&E.cur->row[at + 1], &E.cur->row[at],
+          sizeof(erow) * (E.cur->numrows - at));
+  for (int j = at + 1; j <= E.cur->numrows; j++) E.cur->row[j].idx++;
+  if (!append) editorCacheShift(at, 1);
+
+  editorIndexInsertRows(at, 1);
+  editorBracketInsertRows(at, 1);
+  editorFilterInsertRows(at, 1);
+  editorFoldInsertRows(at, 1);
+  editorUndoInsertRows(at, 1);
+  editorInitRow(&E.cur->row[at], at, s, len, NULL);
+  editorUpdateRow(&E.cur->row[at]);
+
+  E.cur->numrows++;
+  E.cur->dirty++;
+  E.cur->edits++;
+  editorJournalInsert(at, s, len);
+
+  if (append) {
+    if (!E.cur->vindex.stale && E.cur->vindex.n == at)
+      fenwickAppend(&E.cur->vindex, E.cur->row[at].vlines);
+    if (!E.cur->bindex.stale && E.cur->bindex.n == at)
+      fenwickAppend(&E.cur->bindex, E.cur->row[at].size + 1);
+  }
 }
 
 void editorFreeRow(erow *row) {
+  E.cur->digest -= row->hash;
+  editorCacheRemove(row);
   free(row->render);
-  free(row->chars);
+  if (row->shared) editorTextRelease(row->shared);
+  else free(row->chars);
   free(row->hl);
+  free(row->cxmap);
 }
 
 void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--;
-  E.dirty++;
+  if (at < 0 || at >= E.cur->numrows) return;
+  editorJournalFlush();
+  E.cur->vindex.stale = 1;
+  E.cur->bindex.stale = 1;
+  E.cur->diff.stale = 1;
+  editorIndexDeleteRows(at, 1);
+  editorBracketDeleteRows(at, 1);
+  editorFilterDeleteRows(at, 1);
+  editorFoldDeleteRows(at, 1);
+  editorUndoDeleteRows(at, 1);
+  editorFreeRow(&E.cur->row[at]);
+  memmove(&E.cur->row[at], &E.cur->row[at + 1],
+          sizeof(erow) * (E.cur->numrows - at - 1));
+  for (int j = at; j < E.cur->numrows - 1; j++) E.cur->row[j].idx--;
+  editorCacheShift(at + 1, -1);
+  E.cur->numrows--;
+  E.cur->dirty++;
+  E.cur->edits++;
+  editorJournalDelete(at);
+}
+
+void editorReplaceRows(int at, int ndel, char **lines, int *lens, int nins,
+                       struct textBuf **shared) {
+  if (at < 0 || ndel < 0 || at + ndel > E.cur->numrows) return;
+  editorJournalFlush();
+  E.cur->vindex.stale = 1;
+  E.cur->bindex.stale = 1;
+  E.cur->diff.stale = 1;
+
+  editorIndexDeleteRows(at, ndel);
+  editorIndexInsertRows(at, nins);
+  editorBracketDeleteRows(at, ndel);
+  editorBracketInsertRows(at, nins);
+  editorFilterDeleteRows(at, ndel);
+  editorFilterInsertRows(at, nins);
+  editorFoldDeleteRows(at, ndel);
+  editorFoldInsertRows(at, nins);
+  editorUndoDeleteRows(at, ndel);
+  editorUndoInsertRows(at, nins);
+  for (int j = at; j < at + ndel; j++) editorFreeRow(&E.cur->row[j]);
+  editorReserveRows(E.cur->numrows - ndel + nins);
+  memmove(&E.cur->row[at + nins], &E.cur->row[at + ndel],
+          sizeof(erow) * (E.cur->numrows - at - ndel));
+  E.cur->numrows += nins - ndel;
+  for (int j = at + nins; j < E.cur->numrows; j++) E.cur->row[j].idx = j;
+  editorCacheShift(at + ndel, nins - ndel);
+
+  for (int k = 0; k < nins; k++)
+    editorInitRow(&E.cur->row[at + k], at + k, lines[k], lens[k],
+                  shared ? shared[k] : NULL);
+  for (int k = 0; k < nins; k++) editorUpdateRow(&E.cur->row[at + k]);
+  if (at + nins < E.cur->numrows) editorUpdateSyntax(&E.cur->row[at + nins]);
+  E.cur->dirty++;
+  E.cur->edits++;
+  for (int k = 0; k < ndel; k++) editorJournalDelete(at);
+  for (int k = 0; k < nins; k++) editorJournalInsert(at + k, lines[k], lens[k]);
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size) at = row->size;
+  editorRowUnshare(row);
   row->chars = realloc(row->chars, row->size + 2);
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
   editorUpdateRow(row);
-  E.dirty++;
+  E.cur->dirty++;
+  E.cur->edits++;
+  editorJournalRow(row->idx);
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowUnshare(row);
   row->chars = realloc(row->chars, row->size + len + 1);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
   editorUpdateRow(row);
-  E.dirty++;
+  E.cur->dirty++;
+  E.cur->edits++;
+  editorJournalRow(row->idx);
+}
+
+char *editorRowSwapChars(erow *row, char *chars, int size) {
+  editorRowUnshare(row);
+  char *old = row->chars;
+  row->chars = chars;
+  row->size = size;
+  editorUpdateRow(row);
+  E.cur->dirty++;
+  E.cur->edits++;
+  editorJournalRow(row->idx);
+  return old;
+}
+
+void editorRowSplice(erow *row, int from, int to, const char *s, int len) {
+  int size = row->size - (to - from) + len;
+  editorRowUnshare(row);
+  if (len > to - from) row->chars = realloc(row->chars, size + 1);
+  memmove(&row->chars[from + len], &row->chars[to], row->size - to + 1);
+  memcpy(&row->chars[from], s, len);
+  row->size = size;
+  editorUpdateRow(row);
+  E.cur->dirty++;
+  E.cur->edits++;
+  editorJournalRow(row->idx);
 }
 
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
+  int len = editorRowNextChar(row, at) - at;
+  editorRowUnshare(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
   editorUpdateRow(row);
-  E.dirty++;
+  E.cur->dirty++;
+  E.cur->edits++;
+  editorJournalRow(row->idx);
+}
+
+/*** render cache ***/
+
+/* Cached rows are kept in a ring of row indices so the CLOCK hand only
+ * visits rows that hold render data. */
+void editorCacheRemove(erow *row) {
+  struct renderCache *c = &E.cur->cache;
+  c->bytes -= row->cached;
+  row->cached = 0;
+  if (row->slot == -1) return;
+  int last = c->ring[--c->rows];
+  if (row->slot != c->rows) {
+    c->ring[row->slot] = last;
+    E.cur->row[last].slot = row->slot;
+  }
+  row->slot = -1;
+}
+
+void editorCacheShift(int from, int delta) {
+  struct renderCache *c = &E.cur->cache;
+  if (delta == 0) return;
+  for (int k = 0; k < c->rows; k++)
+    if (c->ring[k] >= from) c->ring[k] += delta;
+}
+
+void editorCacheDrop(erow *row) {
+  free(row->render);
+  free(row->hl);
+  free(row->cxmap);
+  row->render = NULL;
+  row->hl = NULL;
+  row->cxmap = NULL;
+  editorCacheRemove(row);
+}
+
+void editorCacheEvict(erow *keep) {
+  struct renderCache *c = &E.cur->cache;
+  while (c->bytes > c->budget && c->rows > 1) {
+    if (c->hand >= c->rows) c->hand = 0;
+    erow *row = &E.cur->row[c->ring[c->hand]];
+    if (row == keep || row->ref) {
+      if (row != keep) row->ref = 0;
+      c->hand++;
+    } else {
+      editorCacheDrop(row);
+      c->evictions++;
+    }
+  }
+}
+
+void editorCacheCharge(erow *row) {
+  struct renderCache *c = &E.cur->cache;
+  int bytes = (row->render ? row->rsize + 1 : 0) + (row->hl ? row->rsize : 0) +
+              (row->cxmap ? sizeof(int) * 2 * (row->size + 1) : 0);
+  if (row->slot == -1) {
+    if (c->rows == c->cap) {
+      c->cap = c->cap ? c->cap * 2 : 1024;
+      c->ring = realloc(c->ring, sizeof(int) * c->cap);
+    }
+    row->slot = c->rows;
+    c->ring[c->rows++] = row->idx;
+  }
+  c->bytes += bytes - row->cached;
+  row->cached = bytes;
+  row->ref = 1;
+  if (c->bytes > c->budget) editorCacheEvict(row);
+}
+
+void editorRowEnsure(erow *row) {
+  row->ref = 1;
+  if (row->render && row->hl) {
+    E.cur->cache.hits++;
+    return;
+  }
+  E.cur->cache.misses++;
+  editorHighlightRow(row);
+}
+
+/* Column maps of evicted rows are rebuilt on first use and charged like
+ * the rest of the render data. */
+int *editorRowMap(erow *row) {
+  if (!row->needmap || row->cxmap) return row->cxmap;
+  E.cur->cache.misses++;
+  row->cxmap = malloc(sizeof(int) * 2 * (row->size + 1));
+  editorRowExpand(row, NULL, row->cxmap, &row->cxmap[row->size + 1]);
+  editorCacheCharge(row);
+  return row->cxmap;
+}
+
+/* Render text for read-only scans. Evicted rows are expanded into *buf
+ * instead of being brought back into the cache. */
+char *editorRowText(erow *row, char **buf, int *cap) {
+  if (row->render) return row->render;
+  if (!row->needmap) return row->chars;
+  if (*cap < row->rsize + 1) {
+    *cap = row->rsize + 1;
+    *buf = realloc(*buf, *cap);
+  }
+  editorRowExpand(row, *buf, NULL, NULL);
+  return *buf;
+}
+
+void editorCacheStats() {
+  struct renderCache *c = &E.cur->cache;
+  long long lookups = c->hits + c->misses;
+  editorSetStatusMessage("Render cache: %lld KiB of %lld KiB, %d/%d rows, "
+                         "hit rate %.1f%%, %lld evicted",
+                         c->bytes / 1024, c->budget / 1024, c->rows,
+                         E.cur->numrows,
+                         lookups ? 100.0 * c->hits / lookups : 100.0,
+                         c->evictions);
 }
 
 /*** editor operations ***/
 
+void editorAppendLine(char *s, int len, int complete) {
+  if (complete && len > 0 && s[len - 1] == '\r') len--;
+  if (E.cur->partial && E.cur->numrows > 0) {
+    erow *row = &E.cur->row[E.cur->numrows - 1];
+    editorRowAppendString(row, s, len);
+    if (complete && row->size > 0 && row->chars[row->size - 1] == '\r') {
+      row->chars[--row->size] = '\0';
+      editorUpdateRow(row);
+    }
+  } else {
+    editorInsertRow(E.cur->numrows, s, len);
+  }
+  E.cur->partial = !complete;
+}
+
 void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+  if (E.cy == E.cur->numrows) {
+    editorInsertRow(E.cur->numrows, "", 0);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  editorRowInsertChar(&E.cur->row[E.cy], E.cx, c);
   E.cx++;
 }
 
@@ -525,296 +2230,4435 @@ void editorInsertNewline() {
   if (E.cx == 0) {
     editorInsertRow(E.cy, "", 0);
   } else {
-    erow *row = &E.row[E.cy];
+    erow *row = &E.cur->row[E.cy];
     editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
+    row = &E.cur->row[E.cy];
+    editorRowUnshare(row);
     row->size = E.cx;
     row->chars[row->size] = '\0';
     editorUpdateRow(row);
+    editorJournalRow(row->idx);
   }
   E.cy++;
   E.cx = 0;
 }
 
 void editorDelChar() {
-  if (E.cy == E.numrows) return;
+  if (E.cy == E.cur->numrows) return;
   if (E.cx == 0 && E.cy == 0) return;
 
-  erow *row = &E.row[E.cy];
+  erow *row = &E.cur->row[E.cy];
   if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
+    E.cx = editorRowPrevChar(row, E.cx);
+    editorRowDelChar(row, E.cx);
   } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    E.cx = E.cur->row[E.cy - 1].size;
+    editorRowAppendString(&E.cur->row[E.cy - 1], row->chars, row->size);
     editorDelRow(E.cy);
     E.cy--;
   }
 }
 
-/*** file i/o ***/
+/*** folding ***/
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  *buflen = totlen;
+void editorFoldUpdate() {
+  struct foldSet *fs = &E.cur->folds;
+  fs->hidden = realloc(fs->hidden, sizeof(int) * (fs->n + 1));
+  fs->hidden[0] = 0;
+  for (int i = 0; i < fs->n; i++)
+    fs->hidden[i + 1] = fs->hidden[i] + fs->folds[i].end - fs->folds[i].start;
+  E.cur->vindex.stale = 1;
+}
 
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+int editorFoldFind(int filerow) {
+  int lo = 0, hi = E.cur->folds.n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.cur->folds.folds[mid].start < filerow) lo = mid + 1;
+    else hi = mid;
   }
+  return lo;
+}
 
-  return buf;
+int editorFoldHidden(int filerow) {
+  int i = editorFoldFind(filerow);
+  return i > 0 && filerow <= E.cur->folds.folds[i - 1].end;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+int editorRowToVisible(int filerow) {
+  struct foldSet *fs = &E.cur->folds;
+  int i = editorFoldFind(filerow);
+  if (i > 0 && filerow <= fs->folds[i - 1].end)
+    return fs->folds[i - 1].start - fs->hidden[i - 1];
+  return filerow - (fs->n ? fs->hidden[i] : 0);
+}
 
-  editorSelectSyntaxHighlight();
+int editorVisibleToRow(int v) {
+  struct foldSet *fs = &E.cur->folds;
+  int lo = 0, hi = fs->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (fs->folds[mid].start - fs->hidden[mid] < v) lo = mid + 1;
+    else hi = mid;
+  }
+  return v + (lo ? fs->hidden[lo] : 0);
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+int editorFoldNextRow(int filerow) {
+  int i = editorFoldFind(filerow);
+  if (i < E.cur->folds.n && E.cur->folds.folds[i].start == filerow)
+    return E.cur->folds.folds[i].end + 1;
+  return filerow + 1;
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
-  }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+void editorFoldRemove(int i) {
+  struct foldSet *fs = &E.cur->folds;
+  memmove(&fs->folds[i], &fs->folds[i + 1], sizeof(struct fold) * (fs->n - i - 1));
+  fs->n--;
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+void editorFoldInsertRows(int at, int n) {
+  struct foldSet *fs = &E.cur->folds;
+  if (fs->n == 0) return;
+  for (int i = fs->n - 1; i >= 0; i--) {
+    if (fs->folds[i].start >= at) {
+      fs->folds[i].start += n;
+      fs->folds[i].end += n;
+    } else if (at <= fs->folds[i].end) {
+      editorFoldRemove(i);
+    } else {
+      break;
     }
-    editorSelectSyntaxHighlight();
   }
+  editorFoldUpdate();
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
+void editorFoldDeleteRows(int at, int n) {
+  struct foldSet *fs = &E.cur->folds;
+  if (fs->n == 0 || n == 0) return;
+  for (int i = fs->n - 1; i >= 0; i--) {
+    if (fs->folds[i].start >= at + n) {
+      fs->folds[i].start -= n;
+      fs->folds[i].end -= n;
+    } else if (at <= fs->folds[i].end) {
+      editorFoldRemove(i);
+    } else {
+      break;
     }
-    close(fd);
   }
+  editorFoldUpdate();
+}
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+void editorFoldReveal(int filerow) {
+  int i = editorFoldFind(filerow);
+  if (i > 0 && filerow <= E.cur->folds.folds[i - 1].end) {
+    editorFoldRemove(i - 1);
+    editorFoldUpdate();
+  }
 }
 
-/*** find ***/
+int editorRowIndent(erow *row) {
+  editorRowEnsure(row);
+  int i = 0;
+  while (i < row->rsize && isspace((unsigned char)row->render[i])) i++;
+  return i == row->rsize ? -1 : i;
+}
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+int editorRowBraceDepth(erow *row) {
+  editorRowEnsure(row);
+  int depth = 0;
+  for (int i = 0; i < row->rsize; i++) {
+    if (row->hl[i] == HL_STRING || row->hl[i] == HL_COMMENT ||
+        row->hl[i] == HL_MLCOMMENT) continue;
+    if (row->render[i] == '{') depth++;
+    else if (row->render[i] == '}') depth--;
+  }
+  return depth;
+}
+
+int editorFoldRange(int filerow, int *end) {
+  int depth = editorRowBraceDepth(&E.cur->row[filerow]);
+  *end = filerow;
+  if (depth > 0) {
+    for (int j = filerow + 1; j < E.cur->numrows; j++) {
+      depth += editorRowBraceDepth(&E.cur->row[j]);
+      *end = j;
+      if (depth <= 0) break;
+    }
+    return *end > filerow;
+  }
+
+  int indent = editorRowIndent(&E.cur->row[filerow]);
+  if (indent == -1) return 0;
+  for (int j = filerow + 1; j < E.cur->numrows; j++) {
+    int ind = editorRowIndent(&E.cur->row[j]);
+    if (ind == -1) continue;
+    if (ind <= indent) break;
+    *end = j;
+  }
+  return *end > filerow;
+}
+
+void editorToggleFold() {
+  struct foldSet *fs = &E.cur->folds;
+  if (E.cy >= E.cur->numrows) return;
+  int i = editorFoldFind(E.cy);
+  if (i < fs->n && fs->folds[i].start == E.cy) {
+    editorFoldRemove(i);
+    editorFoldUpdate();
+    return;
+  }
+
+  int start = -1, end = 0;
+  int indent = editorRowIndent(&E.cur->row[E.cy]);
+  if (indent == -1) indent = INT_MAX;
+  for (int j = E.cy; j >= 0; j--) {
+    int ind = editorRowIndent(&E.cur->row[j]);
+    if (j != E.cy && (ind == -1 || ind >= indent)) continue;
+    if (editorFoldRange(j, &end) && end >= E.cy) {
+      start = j;
+      break;
+    }
+    if (j != E.cy) indent = ind;
+    if (indent == 0) break;
+  }
+  if (start == -1) {
+    editorSetStatusMessage("Nothing to fold here");
+    return;
+  }
+
+  i = editorFoldFind(start);
+  int k = i;
+  while (k < fs->n && fs->folds[k].start <= end) k++;
+  memmove(&fs->folds[i], &fs->folds[k], sizeof(struct fold) * (fs->n - k));
+  fs->n -= k - i;
+  if (fs->n == fs->cap) {
+    fs->cap = fs->cap ? fs->cap * 2 : 16;
+    fs->folds = realloc(fs->folds, sizeof(struct fold) * fs->cap);
+  }
+  memmove(&fs->folds[i + 1], &fs->folds[i], sizeof(struct fold) * (fs->n - i));
+  fs->folds[i].start = start;
+  fs->folds[i].end = end;
+  fs->n++;
+  editorFoldUpdate();
+  E.cy = start;
+  if (E.cx > E.cur->row[start].size) E.cx = E.cur->row[start].size;
+  E.cx = editorRowCharStart(&E.cur->row[start], E.cx);
+}
+
+/*** bracket matching ***/
+
+int editorRowBracketAt(erow *row, int ri) {
+  unsigned char hl = row->hl[ri];
+  if (hl == HL_STRING || hl == HL_COMMENT || hl == HL_MLCOMMENT) return 0;
+  switch (row->render[ri]) {
+    case '(': case '[': case '{': return 1;
+    case ')': case ']': case '}': return -1;
+  }
+  return 0;
+}
+
+void editorBracketCombine(struct bracketNode *n, struct bracketNode *l,
+                          struct bracketNode *r) {
+  n->sum = l->sum + r->sum;
+  n->min = l->min < l->sum + r->min ? l->min : l->sum + r->min;
+  n->max = r->max > r->sum + l->max ? r->max : r->sum + l->max;
+}
+
+/* Rows are grouped into blocks of about NOTEC_BRACKET_BLOCK whose sizes are
+ * kept in a Fenwick tree, and a segment tree combines the block summaries.
+ * Edits only adjust a block's size and mark it dirty; dirty blocks are
+ * summed again, and oversized or empty ones re-chunked, before a lookup. */
+long long editorBracketBlockSize(int b) {
+  return E.cur->brackets.count[b];
+}
+
+int editorBracketBlockOf(int at, int *first) {
+  struct bracketTree *t = &E.cur->brackets;
+  long long off = at;
+  int b = fenwickFind(&t->rows, &off);
+  if (b >= t->nblocks) b = t->nblocks - 1;
+  *first = fenwickPrefix(&t->rows, b);
+  return b;
+}
+
+void editorBracketMarkDirty(int b) {
+  struct bracketTree *t = &E.cur->brackets;
+  if (t->dirty[b]) return;
+  t->dirty[b] = 1;
+  t->pending[t->npending++] = b;
+}
+
+void editorBracketReserve(int nblocks) {
+  struct bracketTree *t = &E.cur->brackets;
+  if (nblocks <= t->cap) return;
+  while (t->cap < nblocks) t->cap = t->cap ? t->cap * 2 : 64;
+  t->count = realloc(t->count, sizeof(int) * t->cap);
+  t->dirty = realloc(t->dirty, t->cap);
+  t->pending = realloc(t->pending, sizeof(int) * t->cap);
+}
+
+void editorBracketSumRows(struct bracketNode *n, int first, int count) {
+  memset(n, 0, sizeof(*n));
+  for (int j = first; j < first + count; j++) {
+    struct bracketNode l = *n;
+    editorBracketCombine(n, &l, &E.cur->row[j].br);
+  }
+}
+
+void editorBracketSetLeaf(int b, int first) {
+  struct bracketTree *t = &E.cur->brackets;
+  int i = t->size + b;
+  editorBracketSumRows(&t->node[i], first, t->count[b]);
+  for (i /= 2; i >= 1; i /= 2)
+    editorBracketCombine(&t->node[i], &t->node[2 * i], &t->node[2 * i + 1]);
+}
+
+void editorBracketInsertRows(int at, int n) {
+  struct bracketTree *t = &E.cur->brackets;
+  if (t->stale || n <= 0) return;
+  int first;
+  int b = editorBracketBlockOf(at, &first);
+  t->count[b] += n;
+  fenwickAdd(&t->rows, b, n);
+  editorBracketMarkDirty(b);
+  if (t->count[b] > 2 * NOTEC_BRACKET_BLOCK) t->relayout = 1;
+}
+
+void editorBracketDeleteRows(int at, int n) {
+  struct bracketTree *t = &E.cur->brackets;
+  if (t->stale) return;
+  while (n > 0) {
+    int first;
+    int b = editorBracketBlockOf(at, &first);
+    int del = first + t->count[b] - at;
+    if (del > n) del = n;
+    if (del <= 0) break;
+    t->count[b] -= del;
+    fenwickAdd(&t->rows, b, -del);
+    editorBracketMarkDirty(b);
+    if (t->count[b] == 0) t->relayout = 1;
+    n -= del;
+  }
+}
+
+void editorBracketRowUpdated(erow *row) {
+  struct bracketNode old = row->br;
+  struct bracketNode *b = &row->br;
+  memset(b, 0, sizeof(*b));
+  for (int i = 0; i < row->rsize; i++) {
+    int d = editorRowBracketAt(row, i);
+    if (d == 0) continue;
+    b->sum += d;
+    if (b->sum < b->min) b->min = b->sum;
+  }
+  int suffix = 0;
+  for (int i = row->rsize - 1; i >= 0; i--) {
+    suffix += editorRowBracketAt(row, i);
+    if (suffix > b->max) b->max = suffix;
+  }
+
+  struct bracketTree *t = &E.cur->brackets;
+  if (t->stale || !memcmp(&old, b, sizeof(old))) return;
+  int first;
+  editorBracketMarkDirty(editorBracketBlockOf(row->idx, &first));
+}
+
+/* Lays the blocks out again from their current sizes: empty blocks are
+ * dropped and oversized ones split, without touching the other rows. With
+ * fresh set, every block is rebuilt from the rows. */
+void editorBracketRelayout(int fresh) {
+  struct bracketTree *t = &E.cur->brackets;
+  int *count = t->count;
+  unsigned char *dirty = t->dirty;
+  struct bracketNode *leaf = t->node ? &t->node[t->size] : NULL;
+  int nblocks = fresh ? 0 : t->nblocks;
+
+  int n = nblocks;
+  for (int b = 0; b < nblocks; b++) n += count[b] / NOTEC_BRACKET_BLOCK;
+  if (fresh)
+    n = (E.cur->numrows + NOTEC_BRACKET_BLOCK - 1) / NOTEC_BRACKET_BLOCK;
+  if (n == 0) n = 1;
+  int size = 1;
+  while (size < n) size *= 2;
+  struct bracketNode *node = calloc(2 * size, sizeof(struct bracketNode));
+  free(t->pending);
+  t->count = NULL;
+  t->dirty = NULL;
+  t->pending = NULL;
+  t->cap = 0;
+  editorBracketReserve(n);
+
+  int k = 0, first = 0;
+  for (int b = 0; b < (fresh ? 1 : nblocks); b++) {
+    int rows = fresh ? E.cur->numrows : count[b];
+    int keep = !fresh && !dirty[b] && rows <= 2 * NOTEC_BRACKET_BLOCK;
+    while (rows > 0) {
+      int take = rows > 2 * NOTEC_BRACKET_BLOCK ? NOTEC_BRACKET_BLOCK : rows;
+      t->count[k] = take;
+      if (keep) node[size + k] = leaf[b];
+      else editorBracketSumRows(&node[size + k], first, take);
+      first += take;
+      rows -= take;
+      k++;
+    }
+  }
+  if (k == 0) t->count[k++] = 0;
+  free(count);
+  free(dirty);
+  free(t->node);
+  t->node = node;
+  t->size = size;
+  t->nblocks = k;
+  memset(t->dirty, 0, k);
+  t->npending = 0;
+  t->relayout = 0;
+  t->stale = 0;
+  for (int i = size - 1; i >= 1; i--)
+    editorBracketCombine(&node[i], &node[2 * i], &node[2 * i + 1]);
+  fenwickBuild(&t->rows, k, editorBracketBlockSize);
+}
+
+void editorBracketIndexUpdate() {
+  struct bracketTree *t = &E.cur->brackets;
+  if (t->stale || t->relayout) {
+    editorBracketRelayout(t->stale);
+    return;
+  }
+  for (int k = 0; k < t->npending; k++) {
+    int b = t->pending[k];
+    t->dirty[b] = 0;
+    editorBracketSetLeaf(b, fenwickPrefix(&t->rows, b));
+  }
+  t->npending = 0;
+}
+
+int editorBracketFindAfter(int i, int lo, int hi, int from, int *depth) {
+  struct bracketNode *n = &E.cur->brackets.node[i];
+  if (hi <= from) return -1;
+  if (lo >= from && *depth + n->min > 0) {
+    *depth += n->sum;
+    return -1;
+  }
+  if (hi - lo == 1) return lo;
+  int mid = (lo + hi) / 2;
+  int r = editorBracketFindAfter(2 * i, lo, mid, from, depth);
+  if (r != -1) return r;
+  return editorBracketFindAfter(2 * i + 1, mid, hi, from, depth);
+}
+
+int editorBracketFindBefore(int i, int lo, int hi, int to, int *depth) {
+  struct bracketNode *n = &E.cur->brackets.node[i];
+  if (lo >= to) return -1;
+  if (hi <= to && n->max < *depth) {
+    *depth -= n->sum;
+    return -1;
+  }
+  if (hi - lo == 1) return lo;
+  int mid = (lo + hi) / 2;
+  int r = editorBracketFindBefore(2 * i + 1, mid, hi, to, depth);
+  if (r != -1) return r;
+  return editorBracketFindBefore(2 * i, lo, mid, to, depth);
+}
+
+int editorBracketRowsAfter(int from, int to, int *depth) {
+  for (int j = from; j < to; j++) {
+    struct bracketNode *b = &E.cur->row[j].br;
+    if (*depth + b->min <= 0) return j;
+    *depth += b->sum;
+  }
+  return -1;
+}
+
+int editorBracketRowsBefore(int from, int to, int *depth) {
+  for (int j = to - 1; j >= from; j--) {
+    struct bracketNode *b = &E.cur->row[j].br;
+    if (b->max >= *depth) return j;
+    *depth -= b->sum;
+  }
+  return -1;
+}
+
+/* The first row at or after from (dir 1), or before from (dir -1), where
+ * the bracket depth carried in reaches zero. */
+int editorBracketFindRow(int from, int dir, int *depth) {
+  struct bracketTree *t = &E.cur->brackets;
+  if (dir > 0 ? from >= E.cur->numrows : from <= 0) return -1;
+  editorBracketIndexUpdate();
+  int first;
+  int b = editorBracketBlockOf(dir > 0 ? from : from - 1, &first);
+  int j = dir > 0 ? editorBracketRowsAfter(from, first + t->count[b], depth)
+                  : editorBracketRowsBefore(first, from, depth);
+  if (j != -1) return j;
+  b = dir > 0 ? editorBracketFindAfter(1, 0, t->size, b + 1, depth)
+              : editorBracketFindBefore(1, 0, t->size, b, depth);
+  if (b == -1 || b >= t->nblocks) return -1;
+  first = fenwickPrefix(&t->rows, b);
+  return dir > 0 ? editorBracketRowsAfter(first, first + t->count[b], depth)
+                 : editorBracketRowsBefore(first, first + t->count[b], depth);
+}
+
+int editorBracketScan(erow *row, int from, int dir, int *depth) {
+  editorRowEnsure(row);
+  for (int i = from; i >= 0 && i < row->rsize; i += dir) {
+    *depth += editorRowBracketAt(row, i) * dir;
+    if (*depth == 0) return i;
+  }
+  return -1;
+}
+
+int editorBracketMatch(int filerow, int ri, int *mrow, int *mri) {
+  if (filerow >= E.cur->numrows) return 0;
+  erow *row = &E.cur->row[filerow];
+  if (ri >= row->rsize) return 0;
+  editorRowEnsure(row);
+  int dir = editorRowBracketAt(row, ri);
+  if (dir == 0) return 0;
+
+  int depth = 1;
+  int i = editorBracketScan(row, ri + dir, dir, &depth);
+  int j = filerow;
+  if (i == -1) {
+    j = editorBracketFindRow(dir > 0 ? filerow + 1 : filerow, dir, &depth);
+    if (j == -1) return 0;
+    row = &E.cur->row[j];
+    i = editorBracketScan(row, dir > 0 ? 0 : row->rsize - 1, dir, &depth);
+    if (i == -1) return 0;
+  }
+  *mrow = j;
+  *mri = i;
+  return 1;
+}
+
+void editorBracketUpdateMatch() {
+  E.cur->brackets.mrow = -1;
+  if (E.cy >= E.cur->numrows) return;
+  erow *row = &E.cur->row[E.cy];
+  if (E.cx >= row->size) return;
+  if (!editorBracketMatch(E.cy, editorRowCxToRi(row, E.cx),
+                          &E.cur->brackets.mrow, &E.cur->brackets.mri))
+    E.cur->brackets.mrow = -1;
+}
+
+void editorBracketJump() {
+  int mrow, mri;
+  erow *row = E.cy < E.cur->numrows ? &E.cur->row[E.cy] : NULL;
+  if (row == NULL || E.cx >= row->size ||
+      !editorBracketMatch(E.cy, editorRowCxToRi(row, E.cx), &mrow, &mri)) {
+    editorSetStatusMessage("No matching bracket");
+    return;
+  }
+  E.cy = mrow;
+  E.cx = editorRowRiToCx(&E.cur->row[mrow], mri);
+}
+
+/*** soft wrap ***/
+
+long long editorRowVisualLines(int at) {
+  return editorFoldHidden(at) ? 0 : E.cur->row[at].vlines;
+}
+
+void editorWrapIndexUpdate() {
+  if (E.cur->vindex.stale || E.cur->vindex.n != E.cur->numrows)
+    fenwickBuild(&E.cur->vindex, E.cur->numrows, editorRowVisualLines);
+}
+
+long long editorVisualLine(int filerow, int rx, int *segstart) {
+  long long v = fenwickPrefix(&E.cur->vindex, filerow);
+  if (segstart) *segstart = 0;
+  if (filerow < E.cur->numrows)
+    v += editorRowWrapSegment(&E.cur->row[filerow], rx, segstart);
+  return v;
+}
+
+void editorVisualToRow(long long v, int *filerow, int *seg) {
+  long long offset = v;
+  *filerow = fenwickFind(&E.cur->vindex, &offset);
+  *seg = offset;
+}
+
+void editorWrapRecompute() {
+  for (int j = 0; j < E.cur->numrows; j++)
+    E.cur->row[j].vlines = editorRowWrapLines(&E.cur->row[j]);
+  E.cur->vindex.stale = 1;
+  E.cur->wrapped = E.wrapgen;
+}
+
+void editorToggleWrap() {
+  E.wrap = !E.wrap;
+  E.wrapoff = 0;
+  if (E.wrap) {
+    E.wrapgen++;
+    editorWrapRecompute();
+    E.coloff = 0;
+  }
+  editorSetStatusMessage(E.wrap ? "Soft wrap on" : "Soft wrap off");
+}
+
+void editorMoveCursorVisual(long long delta) {
+  editorWrapIndexUpdate();
+  erow *row = (E.cy < E.cur->numrows) ? &E.cur->row[E.cy] : NULL;
+  int rx = row ? editorRowCxToRx(row, E.cx) : 0;
+  int start;
+  long long target = editorVisualLine(E.cy, rx, &start) + delta;
+  long long total = fenwickPrefix(&E.cur->vindex, E.cur->numrows);
+  if (target < 0) target = 0;
+  if (target > total) target = total;
+
+  int seg;
+  editorVisualToRow(target, &E.cy, &seg);
+  if (E.cy >= E.cur->numrows) {
+    E.cy = E.cur->numrows;
+    E.cx = 0;
+    return;
+  }
+
+  row = &E.cur->row[E.cy];
+  int col = editorRowWrapStart(row, seg) + (rx - start);
+  if (seg + 1 < row->vlines) {
+    int next = editorRowWrapStart(row, seg + 1);
+    if (col >= next) col = next - 1;
+  }
+  E.cx = editorRowRxToCx(row, col);
+}
+
+/*** navigation ***/
+
+long long editorRowByteSize(int at) {
+  return E.cur->row[at].size + 1;
+}
+
+void editorByteIndexUpdate() {
+  if (E.cur->bindex.stale || E.cur->bindex.n != E.cur->numrows)
+    fenwickBuild(&E.cur->bindex, E.cur->numrows, editorRowByteSize);
+}
+
+long long editorRowOffset(int filerow) {
+  editorByteIndexUpdate();
+  return fenwickPrefix(&E.cur->bindex, filerow);
+}
+
+int editorOffsetToRow(long long offset, int *col) {
+  editorByteIndexUpdate();
+  int filerow = fenwickFind(&E.cur->bindex, &offset);
+  if (filerow >= E.cur->numrows) {
+    *col = 0;
+    return E.cur->numrows;
+  }
+  *col = offset < E.cur->row[filerow].size ? offset : E.cur->row[filerow].size;
+  return filerow;
+}
+
+void editorJumpTo(int filerow, int cx) {
+  if (filerow < 0) filerow = 0;
+  if (filerow > E.cur->numrows) filerow = E.cur->numrows;
+  E.cy = filerow;
+  E.cx = 0;
+  if (filerow < E.cur->numrows) {
+    erow *row = &E.cur->row[filerow];
+    if (cx > row->size) cx = row->size;
+    if (cx < 0) cx = 0;
+    E.cx = editorRowCharStart(row, cx);
+  }
+
+  if (E.wrap) {
+    E.rowoff = filerow;
+    E.wrapoff = 0;
+  } else if (filerow < E.rowoff || filerow >= E.rowoff + E.screenrows) {
+    E.rowoff = filerow > E.screenrows / 2 ? filerow - E.screenrows / 2 : 0;
+  }
+}
+
+void editorGoTo() {
+  char *query = editorPrompt("Go to line[:col], N%% or @offset: %s", NULL);
+  if (query == NULL) return;
+
+  char *end;
+  if (query[0] == '@') {
+    long long offset = strtoll(&query[1], &end, 0);
+    if (end == &query[1] || *end != '\0' || offset < 0) {
+      editorSetStatusMessage("Bad offset: %s", query);
+    } else {
+      int col;
+      int filerow = editorOffsetToRow(offset, &col);
+      editorJumpTo(filerow, col);
+      editorSetStatusMessage("Offset %lld is line %d, column %d", offset,
+                             filerow + 1, col + 1);
+    }
+  } else {
+    long long n = strtoll(query, &end, 10);
+    if (end == query || n < 0) {
+      editorSetStatusMessage("Bad position: %s", query);
+    } else if (*end == '%' && end[1] == '\0') {
+      if (n > 100) n = 100;
+      editorJumpTo(E.cur->numrows ? (E.cur->numrows - 1) * n / 100 : 0, 0);
+    } else if (*end == ':' || *end == '\0') {
+      long long col = (*end == ':') ? strtoll(end + 1, NULL, 10) : 1;
+      if (n > E.cur->numrows) n = E.cur->numrows;
+      editorJumpTo(n > 0 ? n - 1 : 0, col > 0 ? col - 1 : 0);
+    } else {
+      editorSetStatusMessage("Bad position: %s", query);
+    }
+  }
+  free(query);
+}
+
+/*** compression ***/
+
+struct codec Codecs[] = {
+  { ".gz", { "gzip", "-dc", NULL }, { "gzip", "-c", NULL } },
+  { ".zst", { "zstd", "-dcq", NULL }, { "zstd", "-cq", NULL } },
+};
+
+#define CODECS_ENTRIES (sizeof(Codecs) / sizeof(Codecs[0]))
+
+struct codec *editorFileCodec(const char *filename) {
+  size_t len = strlen(filename);
+  for (unsigned int j = 0; j < CODECS_ENTRIES; j++) {
+    size_t slen = strlen(Codecs[j].suffix);
+    if (len > slen && !strcmp(&filename[len - slen], Codecs[j].suffix))
+      return &Codecs[j];
+  }
+  return NULL;
+}
+
+pid_t editorSpawnFilter(char **argv, int in, int out) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    if (null != -1) dup2(null, STDERR_FILENO);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  return pid;
+}
+
+int editorFilterStatus(pid_t pid) {
+  int status;
+  while (waitpid(pid, &status, 0) == -1)
+    if (errno != EINTR) return -1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int editorOpenDecompressor(struct codec *codec, const char *filename,
+                           pid_t *pid) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -1;
+  int pfd[2];
+  if (pipe2(pfd, O_CLOEXEC) == -1) {
+    close(fd);
+    return -1;
+  }
+  *pid = editorSpawnFilter(codec->decompress, fd, pfd[1]);
+  close(fd);
+  close(pfd[1]);
+  if (*pid == -1) {
+    close(pfd[0]);
+    return -1;
+  }
+  return pfd[0];
+}
+
+void editorStreamClose() {
+  close(E.cur->stream.fd);
+  E.cur->stream.fd = -1;
+  if (editorFilterStatus(E.cur->stream.pid) != 0)
+    editorSetStatusMessage("%s failed to decompress %.20s",
+                           E.cur->stream.codec->decompress[0], E.cur->filename);
+  E.cur->partial = 0;
+  editorDiskSnapshot(0);
+}
+
+int editorStreamRead() {
+  char buf[65536];
+  int dirty = E.cur->dirty;
+  E.cur->journal.paused++;
+  for (int chunk = 0; chunk < 64; chunk++) {
+    ssize_t n = read(E.cur->stream.fd, buf, sizeof(buf));
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) break;
+    if (n <= 0) {
+      editorStreamClose();
+      break;
+    }
+    char *p = buf, *end = buf + n;
+    char *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+      editorAppendLine(p, nl - p, 1);
+      p = nl + 1;
+    }
+    if (p < end) editorAppendLine(p, end - p, 0);
+  }
+  E.cur->dirty = dirty;
+  E.cur->journal.paused--;
+  return 1;
+}
+
+void editorStreamOpen(struct codec *codec, char *filename) {
+  E.cur->stream.fd = editorOpenDecompressor(codec, filename,
+                                            &E.cur->stream.pid);
+  if (E.cur->stream.fd == -1) die("open");
+  fcntl(E.cur->stream.fd, F_SETFL, O_NONBLOCK);
+  E.cur->stream.codec = codec;
+
+  while (E.cur->stream.fd != -1 && E.cur->numrows <= E.screenrows) {
+    struct pollfd pfd = { E.cur->stream.fd, POLLIN, 0 };
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) die("poll");
+    editorStreamRead();
+  }
+}
+
+long long editorWriteCompressed(struct codec *codec, int fd) {
+  int pfd[2];
+  if (pipe2(pfd, O_CLOEXEC) == -1) return -1;
+  pid_t pid = editorSpawnFilter(codec->compress, pfd[0], fd);
+  close(pfd[0]);
+  if (pid == -1) {
+    close(pfd[1]);
+    return -1;
+  }
+
+  char buf[65536];
+  int len = 0, ok = 1;
+  long long total = 0;
+  for (int j = 0; j <= E.cur->numrows && ok; j++) {
+    erow *row = j < E.cur->numrows ? &E.cur->row[j] : NULL;
+    if (len > 0 && (row == NULL || len + row->size + 1 > (int)sizeof(buf))) {
+      ok = write(pfd[1], buf, len) == len;
+      len = 0;
+    }
+    if (row == NULL) break;
+    if (row->size + 1 > (int)sizeof(buf)) {
+      ok = write(pfd[1], row->chars, row->size) == row->size &&
+           write(pfd[1], "\n", 1) == 1;
+    } else {
+      memcpy(&buf[len], row->chars, row->size);
+      len += row->size;
+      buf[len++] = '\n';
+    }
+    total += row->size + 1;
+  }
+  close(pfd[1]);
+  if (editorFilterStatus(pid) != 0) ok = 0;
+  return ok ? total : -1;
+}
+
+void editorSaveCompressed(struct codec *codec) {
+  char *tmp = editorSidecarPath(E.cur->filename, "notec-save");
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  struct stat st;
+  if (fd != -1 && stat(E.cur->filename, &st) == 0)
+    fchmod(fd, st.st_mode & 07777);
+  long long len = fd != -1 ? editorWriteCompressed(codec, fd) : -1;
+  if (fd != -1 && close(fd) == -1) len = -1;
+  if (len == -1 || rename(tmp, E.cur->filename) == -1) {
+    if (fd != -1) unlink(tmp);
+    free(tmp);
+    editorSetStatusMessage("Can't save! %s failed", codec->compress[0]);
+    return;
+  }
+  free(tmp);
+  E.cur->dirty = 0;
+  E.cur->partial = 0;
+  editorDiskSnapshot(0);
+  editorJournalReset();
+  editorIndexSave();
+  editorSetStatusMessage("%lld bytes compressed to disk", len);
+}
+
+/*** file i/o ***/
+
+char *editorSidecarPath(const char *filename, const char *suffix) {
+  const char *slash = strrchr(filename, '/');
+  const char *base = slash ? slash + 1 : filename;
+  int dirlen = slash ? slash - filename + 1 : 0;
+  size_t len = strlen(filename) + strlen(suffix) + 3;
+  char *path = malloc(len);
+  snprintf(path, len, "%.*s.%s.%s", dirlen, filename, base, suffix);
+  return path;
+}
+
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  int j;
+  for (j = 0; j < E.cur->numrows; j++)
+    totlen += E.cur->row[j].size + 1;
+  *buflen = totlen;
+
+  char *buf = malloc(totlen);
+  char *p = buf;
+  for (j = 0; j < E.cur->numrows; j++) {
+    memcpy(p, E.cur->row[j].chars, E.cur->row[j].size);
+    p += E.cur->row[j].size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+void editorOpen(char *filename) {
+  free(E.cur->filename);
+  E.cur->filename = strdup(filename);
+
+  editorSelectSyntaxHighlight();
+
+  struct codec *codec = editorFileCodec(filename);
+  if (codec) {
+    editorStreamOpen(codec, filename);
+    return;
+  }
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp) die("fopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  E.cur->journal.paused++;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    E.cur->fileoff += linelen;
+    E.cur->partial = line[linelen - 1] != '\n';
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                           line[linelen - 1] == '\r'))
+      linelen--;
+    editorInsertRow(E.cur->numrows, line, linelen);
+  }
+  free(line);
+  fclose(fp);
+  E.cur->journal.paused--;
+  editorDiskSnapshot(0);
+  E.cur->dirty = 0;
+}
+
+void editorSave() {
+  if (E.cur->filename == NULL) {
+    E.cur->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.cur->filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  if (E.cur->stream.fd != -1) {
+    editorSetStatusMessage("Still loading %.20s, try again shortly",
+                           E.cur->filename);
+    return;
+  }
+
+  int unchanged = editorDiskUnchanged();
+  if (unchanged && E.cur->disk.valid && !editorModified()) {
+    E.cur->dirty = 0;
+    editorJournalReset();
+    editorSetStatusMessage("No changes to save");
+    return;
+  }
+
+  if (!unchanged &&
+      !editorConfirm("%.20s changed on disk since it was read. "
+                     "Overwrite? (y/n)", E.cur->filename)) {
+    editorSetStatusMessage("Save aborted");
+    return;
+  }
+
+  struct codec *codec = editorFileCodec(E.cur->filename);
+  if (codec) {
+    editorSaveCompressed(codec);
+    return;
+  }
+
+  int len;
+  char *buf = editorRowsToString(&len);
+
+  int fd = open(E.cur->filename, O_RDWR | O_CREAT, 0644);
+  if (fd != -1) {
+    if (ftruncate(fd, len) != -1) {
+      if (write(fd, buf, len) == len) {
+        close(fd);
+        free(buf);
+        E.cur->dirty = 0;
+        E.cur->fileoff = len;
+        E.cur->partial = 0;
+        editorDiskSnapshot(0);
+        editorJournalReset();
+        editorIndexSave();
+        editorSetStatusMessage("%d bytes written to disk", len);
+        return;
+      }
+    }
+    close(fd);
+  }
+
+  free(buf);
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** follow ***/
+
+int editorFollowRead() {
+  struct stat st;
+  if (fstat(E.cur->followfd, &st) == -1) return 0;
+  if (st.st_size < E.cur->fileoff) {
+    E.cur->fileoff = 0;
+    E.cur->partial = 0;
+    editorSetStatusMessage("File truncated, following from the start");
+  }
+  if (st.st_size == E.cur->fileoff) return 0;
+
+  int dirty = E.cur->dirty;
+  int pinned = E.cy >= E.cur->numrows - 1;
+  E.cur->journal.paused++;
+  int from = E.cur->numrows > 0 ? E.cur->numrows - 1 : 0;
+  char buf[65536];
+  ssize_t n;
+  while ((n = pread(E.cur->followfd, buf, sizeof(buf), E.cur->fileoff)) > 0) {
+    char *p = buf, *end = buf + n;
+    char *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+      editorAppendLine(p, nl - p, 1);
+      p = nl + 1;
+    }
+    if (p < end) editorAppendLine(p, end - p, 0);
+    E.cur->fileoff += n;
+  }
+  E.cur->dirty = dirty;
+  E.cur->journal.paused--;
+  editorDiskSnapshot(from);
+
+  if (pinned && E.cur->numrows > 0) {
+    E.cy = E.cur->numrows - 1;
+    E.cx = 0;
+  }
+  return 1;
+}
+
+void editorFollowStop() {
+  if (E.cur->watchfd != -1) close(E.cur->watchfd);
+  if (E.cur->followfd != -1) close(E.cur->followfd);
+  E.cur->watchfd = E.cur->followfd = -1;
+  E.cur->follow = 0;
+}
+
+void editorFollowStart() {
+  if (E.cur->filename == NULL) {
+    editorSetStatusMessage("No file to follow");
+    return;
+  }
+  if (editorFileCodec(E.cur->filename)) {
+    editorSetStatusMessage("Can't follow a compressed file");
+    return;
+  }
+  E.cur->followfd = open(E.cur->filename, O_RDONLY | O_CLOEXEC);
+  E.cur->watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.cur->followfd == -1 || E.cur->watchfd == -1 ||
+      inotify_add_watch(E.cur->watchfd, E.cur->filename, IN_MODIFY) == -1) {
+    editorSetStatusMessage("Can't follow: %s", strerror(errno));
+    editorFollowStop();
+    return;
+  }
+  E.cur->follow = 1;
+  editorFollowRead();
+  E.cy = E.cur->numrows > 0 ? E.cur->numrows - 1 : 0;
+  E.cx = 0;
+  editorSetStatusMessage("Following %s (Ctrl-T to stop)", E.cur->filename);
+}
+
+void editorToggleFollow() {
+  if (E.cur->follow) {
+    editorFollowStop();
+    editorSetStatusMessage("Stopped following");
+  } else {
+    editorFollowStart();
+  }
+}
+
+int editorFollowEvents() {
+  char buf[4096];
+  while (read(E.cur->watchfd, buf, sizeof(buf)) > 0);
+  return editorFollowRead();
+}
+
+/*** disk sync ***/
+
+int editorStampFile(const char *path, struct fileStamp *fs) {
+  struct stat st;
+  if (stat(path, &st) == -1) return -1;
+  fs->dev = st.st_dev;
+  fs->ino = st.st_ino;
+  fs->size = st.st_size;
+  fs->mtime = st.st_mtim;
+  return 0;
+}
+
+int editorStampEqual(struct fileStamp *a, struct fileStamp *b) {
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+         a->mtime.tv_sec == b->mtime.tv_sec &&
+         a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+void editorDiskSnapshot(int from) {
+  if (E.cur->filename == NULL) return;
+  if (from > E.cur->disk.nhash) from = E.cur->disk.nhash;
+  for (int j = from; j < E.cur->disk.nhash; j++)
+    E.cur->disk.digest -= E.cur->disk.hash[j];
+  E.cur->disk.hash = realloc(E.cur->disk.hash,
+                             sizeof(uint64_t) * (E.cur->numrows + 1));
+  for (int j = from; j < E.cur->numrows; j++) {
+    E.cur->disk.hash[j] = E.cur->row[j].hash;
+    E.cur->disk.digest += E.cur->disk.hash[j];
+  }
+  E.cur->disk.nhash = E.cur->numrows;
+  E.cur->disk.verified = -1;
+  E.cur->diff.stale = 1;
+  E.cur->disk.valid = editorStampFile(E.cur->filename, &E.cur->disk.stamp) == 0;
+  E.cur->disk.seen = E.cur->disk.stamp;
+}
+
+int editorReadDiskLines(const char *path, struct diskLines *dl) {
+  memset(dl, 0, sizeof(*dl));
+  struct codec *codec = editorFileCodec(path);
+  pid_t pid = -1;
+  int fd = codec ? editorOpenDecompressor(codec, path, &pid)
+                 : open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -1;
+
+  size_t len = 0, cap = 65536;
+  dl->buf = malloc(cap);
+  ssize_t n;
+  while ((n = read(fd, dl->buf + len, cap - len)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    len += n;
+    if (len == cap) dl->buf = realloc(dl->buf, cap *= 2);
+  }
+  close(fd);
+  if (n == -1 || (pid != -1 && editorFilterStatus(pid) != 0)) {
+    free(dl->buf);
+    return -1;
+  }
+
+  int linecap = 0;
+  char *p = dl->buf, *end = dl->buf + len;
+  while (p < end) {
+    char *nl = memchr(p, '\n', end - p);
+    int linelen = (nl ? nl : end) - p;
+    while (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+    if (dl->n == linecap) {
+      linecap = linecap ? linecap * 2 : 1024;
+      dl->lines = realloc(dl->lines, sizeof(char *) * linecap);
+      dl->lens = realloc(dl->lens, sizeof(int) * linecap);
+      dl->hash = realloc(dl->hash, sizeof(uint64_t) * linecap);
+    }
+    dl->lines[dl->n] = p;
+    dl->lens[dl->n] = linelen;
+    dl->hash[dl->n] = editorHash(p, linelen);
+    dl->n++;
+    p = nl ? nl + 1 : end;
+  }
+  return 0;
+}
+
+void editorFreeDiskLines(struct diskLines *dl) {
+  free(dl->buf);
+  free(dl->lines);
+  free(dl->lens);
+  free(dl->hash);
+}
+
+int editorDiskLinesChanged(struct diskLines *dl) {
+  if (dl->n != E.cur->disk.nhash) return 1;
+  for (int j = 0; j < dl->n; j++)
+    if (dl->hash[j] != E.cur->disk.hash[j]) return 1;
+  return 0;
+}
+
+int editorDiskUnchanged() {
+  struct fileStamp fs;
+  if (!E.cur->disk.valid || editorStampFile(E.cur->filename, &fs) == -1)
+    return 1;
+  if (editorStampEqual(&fs, &E.cur->disk.stamp)) return 1;
+
+  struct diskLines dl;
+  if (editorReadDiskLines(E.cur->filename, &dl) == -1) return 1;
+  int changed = editorDiskLinesChanged(&dl);
+  editorFreeDiskLines(&dl);
+  return !changed;
+}
+
+/* The digest is a sum of row hashes, so it ignores row order; only when it
+ * matches are the rows compared in order, once per edit generation. */
+int editorModified() {
+  if (!E.cur->dirty) return 0;
+  if (E.cur->digest != E.cur->disk.digest ||
+      E.cur->numrows != E.cur->disk.nhash) return 1;
+  if (E.cur->disk.verified == E.cur->edits) return E.cur->disk.differs;
+  E.cur->disk.verified = E.cur->edits;
+  E.cur->disk.differs = 0;
+  for (int j = 0; j < E.cur->numrows; j++) {
+    if (E.cur->row[j].hash != E.cur->disk.hash[j]) {
+      E.cur->disk.differs = 1;
+      break;
+    }
+  }
+  return E.cur->disk.differs;
+}
+
+void editorReloadRows(struct diskLines *dl) {
+  int common = E.cur->numrows < dl->n ? E.cur->numrows : dl->n;
+  int prefix = 0, suffix = 0;
+  while (prefix < common && E.cur->row[prefix].hash == dl->hash[prefix])
+    prefix++;
+  while (suffix < common - prefix &&
+         E.cur->row[E.cur->numrows - 1 - suffix].hash ==
+           dl->hash[dl->n - 1 - suffix])
+    suffix++;
+
+  int oldrows = E.cur->numrows;
+  int ndel = oldrows - prefix - suffix;
+  int nins = dl->n - prefix - suffix;
+  editorReplaceRows(prefix, ndel, &dl->lines[prefix], &dl->lens[prefix], nins,
+                    NULL);
+
+  int shift = nins - ndel;
+  if (E.cy >= oldrows - suffix) E.cy += shift;
+  else if (E.cy >= E.cur->numrows) E.cy = E.cur->numrows;
+  if (E.rowoff >= oldrows - suffix) E.rowoff += shift;
+  if (E.rowoff > E.cur->numrows) E.rowoff = E.cur->numrows;
+  if (E.cy < E.cur->numrows) {
+    erow *row = &E.cur->row[E.cy];
+    if (E.cx > row->size) E.cx = row->size;
+    E.cx = editorRowCharStart(row, E.cx);
+  } else {
+    E.cx = 0;
+  }
+
+  free(E.cur->disk.hash);
+  E.cur->disk.hash = dl->hash;
+  E.cur->disk.nhash = dl->n;
+  E.cur->disk.digest = 0;
+  for (int j = 0; j < dl->n; j++) E.cur->disk.digest += dl->hash[j];
+  E.cur->disk.verified = -1;
+  E.cur->diff.stale = 1;
+  E.cur->brackets.stale = 1;
+  dl->hash = NULL;
+  E.cur->dirty = 0;
+  editorJournalReset();
+  editorSetStatusMessage("Reloaded: %d line%s replaced by %d", ndel,
+                         ndel == 1 ? "" : "s", nins);
+}
+
+int editorCheckDisk() {
+  if (!E.cur->disk.valid || E.cur->follow) return 0;
+  long long now = editorNowMs();
+  if (now - E.cur->disk.checked < NOTEC_DISK_CHECK_MS) return 0;
+  E.cur->disk.checked = now;
+
+  struct fileStamp fs;
+  if (editorStampFile(E.cur->filename, &fs) == -1) return 0;
+  if (editorStampEqual(&fs, &E.cur->disk.stamp) ||
+      editorStampEqual(&fs, &E.cur->disk.seen)) return 0;
+  E.cur->disk.seen = fs;
+
+  struct diskLines dl;
+  if (editorReadDiskLines(E.cur->filename, &dl) == -1) return 0;
+  if (!editorDiskLinesChanged(&dl)) {
+    E.cur->disk.stamp = fs;
+    editorFreeDiskLines(&dl);
+    return 0;
+  }
+
+  if (editorConfirm(editorModified() ?
+        "%.20s changed on disk. Reload and lose your changes? (y/n)" :
+        "%.20s changed on disk. Reload? (y/n)", E.cur->filename)) {
+    editorReloadRows(&dl);
+    E.cur->disk.stamp = fs;
+  } else {
+    editorSetStatusMessage("Kept buffer; saving will ask before overwriting");
+  }
+  editorFreeDiskLines(&dl);
+  return 1;
+}
+
+
+/*** diff ***/
+
+void editorDiffEmit(int a0, int a1, int b0, int b1) {
+  struct diffView *d = &E.cur->diff;
+  if (d->n == d->cap) {
+    d->cap = d->cap ? d->cap * 2 : 64;
+    d->hunks = realloc(d->hunks, sizeof(struct diffHunk) * d->cap);
+  }
+  d->hunks[d->n++] = (struct diffHunk){ a0, a1, b0, b1 };
+}
+
+void editorDiffSnake(struct diffJob *job, int a0, int n, int b0, int m,
+                     int *sx, int *sy, int *ex, int *ey) {
+  const uint64_t *a = job->a + a0, *b = job->b + b0;
+  int max = (n + m + 1) / 2;
+  int delta = n - m;
+  int odd = delta & 1;
+  int *vf = job->vf + max + 1;
+  int *vb = job->vb + max + 1;
+  vf[1] = 0;
+  vb[1] = 0;
+  for (int d = 0; d <= max; d++) {
+    job->cost += d + 1;
+    if (d > job->limit) {
+      /* Too expensive: split at the furthest forward point instead. */
+      int best = 0;
+      *sx = *ex = n / 2;
+      *sy = *ey = m / 2;
+      for (int k = -d + 1; k <= d - 1; k += 2) {
+        int x = vf[k], y = vf[k] - k;
+        if (x > n || y > m || x + y >= n + m) continue;
+        if (x + y > best) {
+          best = x + y;
+          *sx = *ex = x;
+          *sy = *ey = y;
+        }
+      }
+      return;
+    }
+    for (int k = -d; k <= d; k += 2) {
+      int x = (k == -d || (k != d && vf[k - 1] < vf[k + 1]))
+                ? vf[k + 1] : vf[k - 1] + 1;
+      int y = x - k;
+      int x0 = x, y0 = y;
+      while (x < n && y < m && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      vf[k] = x;
+      if (odd && delta - k >= -(d - 1) && delta - k <= d - 1 &&
+          x + vb[delta - k] >= n) {
+        *sx = x0;
+        *sy = y0;
+        *ex = x;
+        *ey = y;
+        return;
+      }
+    }
+    for (int k = -d; k <= d; k += 2) {
+      int x = (k == -d || (k != d && vb[k - 1] < vb[k + 1]))
+                ? vb[k + 1] : vb[k - 1] + 1;
+      int y = x - k;
+      int x0 = x, y0 = y;
+      while (x < n && y < m && a[n - 1 - x] == b[m - 1 - y]) {
+        x++;
+        y++;
+      }
+      vb[k] = x;
+      if (!odd && delta - k >= -d && delta - k <= d &&
+          x + vf[delta - k] >= n) {
+        *sx = n - x;
+        *sy = m - y;
+        *ex = n - x0;
+        *ey = m - y0;
+        return;
+      }
+    }
+  }
+}
+
+void editorDiffCompare(struct diffJob *job, int a0, int a1, int b0, int b1) {
+  while (a0 < a1 && b0 < b1 && job->a[a0] == job->b[b0]) {
+    a0++;
+    b0++;
+  }
+  while (a0 < a1 && b0 < b1 && job->a[a1 - 1] == job->b[b1 - 1]) {
+    a1--;
+    b1--;
+  }
+  if (a0 == a1 || b0 == b1) {
+    for (int i = a0; i < a1; i++) job->adel[job->amap[i]] = 1;
+    for (int j = b0; j < b1; j++) job->bins[job->bmap[j]] = 1;
+    return;
+  }
+
+  /* Past the budget only cheap, possibly non-minimal splits are made. */
+  if (job->cost > NOTEC_DIFF_BUDGET) job->limit = 16;
+  int sx, sy, ex, ey;
+  editorDiffSnake(job, a0, a1 - a0, b0, b1 - b0, &sx, &sy, &ex, &ey);
+  editorDiffCompare(job, a0, a0 + sx, b0, b0 + sy);
+  editorDiffCompare(job, a0 + ex, a1, b0 + ey, b1);
+}
+
+/* Rows whose hash never occurs on the other side can only be inserted or
+ * deleted, so they are marked up front and kept out of the search. */
+int editorDiffDiscard(const uint64_t *v, int n, const unsigned char *other,
+                      uint64_t mask, unsigned char *changed, uint64_t *keep,
+                      int *map) {
+  int kept = 0;
+  for (int i = 0; i < n; i++) {
+    uint64_t bit = v[i] & mask;
+    if (other[bit >> 3] & (1 << (bit & 7))) {
+      keep[kept] = v[i];
+      map[kept++] = i;
+    } else {
+      changed[i] = 1;
+    }
+  }
+  return kept;
+}
+
+void editorDiffUpdate() {
+  struct diffView *d = &E.cur->diff;
+  d->stale = 0;
+  d->n = 0;
+
+  int n = E.cur->disk.nhash, m = E.cur->numrows;
+  int prefix = 0, suffix = 0;
+  while (prefix < n && prefix < m &&
+         E.cur->disk.hash[prefix] == E.cur->row[prefix].hash)
+    prefix++;
+  while (suffix < n - prefix && suffix < m - prefix &&
+         E.cur->disk.hash[n - 1 - suffix] == E.cur->row[m - 1 - suffix].hash)
+    suffix++;
+  n -= prefix + suffix;
+  m -= prefix + suffix;
+  if (n == 0 && m == 0) return;
+
+  uint64_t *a = malloc(sizeof(uint64_t) * (n + 1));
+  uint64_t *b = malloc(sizeof(uint64_t) * (m + 1));
+  for (int i = 0; i < n; i++) a[i] = E.cur->disk.hash[prefix + i];
+  for (int j = 0; j < m; j++) b[j] = E.cur->row[prefix + j].hash;
+
+  uint64_t nbits = 1024;
+  while (nbits < 16 * (uint64_t)(n + m)) nbits *= 2;
+  unsigned char *abits = calloc(nbits / 8, 2);
+  unsigned char *bbits = abits + nbits / 8;
+  for (int i = 0; i < n; i++)
+    abits[(a[i] & (nbits - 1)) >> 3] |= 1 << (a[i] & 7);
+  for (int j = 0; j < m; j++)
+    bbits[(b[j] & (nbits - 1)) >> 3] |= 1 << (b[j] & 7);
+
+  struct diffJob job;
+  unsigned char *changed = calloc(n + m + 1, 1);
+  job.adel = changed;
+  job.bins = changed + n;
+  job.amap = malloc(sizeof(int) * (n + m + 1));
+  job.bmap = job.amap + n;
+  int kn = editorDiffDiscard(a, n, bbits, nbits - 1, job.adel, a, job.amap);
+  int km = editorDiffDiscard(b, m, abits, nbits - 1, job.bins, b, job.bmap);
+  free(abits);
+
+  int size = kn + km + 4;
+  job.a = a;
+  job.b = b;
+  job.vf = malloc(sizeof(int) * size * 2);
+  job.vb = job.vf + size;
+  job.limit = 256;
+  job.cost = 0;
+  while ((long long)job.limit * job.limit < kn + km) job.limit *= 2;
+  editorDiffCompare(&job, 0, kn, 0, km);
+
+  int i = 0, j = 0;
+  while (i < n || j < m) {
+    if (i < n && j < m && !job.adel[i] && !job.bins[j]) {
+      i++;
+      j++;
+      continue;
+    }
+    int a0 = i, b0 = j;
+    while (i < n && job.adel[i]) i++;
+    while (j < m && job.bins[j]) j++;
+    editorDiffEmit(prefix + a0, prefix + i, prefix + b0, prefix + j);
+  }
+
+  free(job.vf);
+  free(job.amap);
+  free(changed);
+  free(a);
+  free(b);
+}
+
+int editorDiffMark(int filerow) {
+  struct diffView *d = &E.cur->diff;
+  int lo = 0, hi = d->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (d->hunks[mid].b0 <= filerow) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo > 0) {
+    struct diffHunk *h = &d->hunks[lo - 1];
+    if (filerow < h->b1)
+      return h->a0 == h->a1 ? HL_DIFF_ADD : HL_DIFF_CHANGE;
+    if (h->b0 == filerow) return HL_DIFF_DELETE;
+  }
+  if (filerow == E.cur->numrows - 1 && lo == d->n - 1 &&
+      d->hunks[lo].b0 == E.cur->numrows)
+    return HL_DIFF_DELETE;
+  return HL_NORMAL;
+}
+
+void editorToggleDiff() {
+  if (!E.cur->diff.active) {
+    if (E.cur->filename == NULL) {
+      editorSetStatusMessage("No file on disk to compare with");
+      return;
+    }
+    if (E.cur->stream.fd != -1) {
+      editorSetStatusMessage("Still loading %.20s, try again shortly",
+                             E.cur->filename);
+      return;
+    }
+  }
+  E.cur->diff.active = !E.cur->diff.active;
+  E.cur->diff.stale = 1;
+  editorLayout();
+  if (!E.cur->diff.active) return;
+
+  editorDiffUpdate();
+  int added = 0, removed = 0;
+  for (int j = 0; j < E.cur->diff.n; j++) {
+    added += E.cur->diff.hunks[j].b1 - E.cur->diff.hunks[j].b0;
+    removed += E.cur->diff.hunks[j].a1 - E.cur->diff.hunks[j].a0;
+  }
+  editorSetStatusMessage("Diff against disk: %d hunk%s, +%d -%d", E.cur->diff.n,
+                         E.cur->diff.n == 1 ? "" : "s", added, removed);
+}
+/*** journal ***/
+
+void editorJournalPut(const void *p, int len) {
+  struct journal *j = &E.cur->journal;
+  if (j->len + len > j->cap) {
+    while (j->len + len > j->cap) j->cap = j->cap ? j->cap * 2 : 4096;
+    j->buf = realloc(j->buf, j->cap);
+  }
+  memcpy(&j->buf[j->len], p, len);
+  j->len += len;
+}
+
+void editorJournalHeader() {
+  int64_t stamp[3] = {
+    E.cur->disk.stamp.size, E.cur->disk.stamp.mtime.tv_sec,
+    E.cur->disk.stamp.mtime.tv_nsec
+  };
+  uint32_t version = NOTEC_JOURNAL_VERSION;
+  editorJournalPut("NJNL", 4);
+  editorJournalPut(&version, 4);
+  editorJournalPut(stamp, sizeof(stamp));
+}
+
+uint32_t editorJournalSum(int type, int32_t at, const char *s, int32_t len) {
+  return (uint32_t)(editorHash(s, len) ^ ((uint64_t)type << 56) ^
+                    ((uint64_t)(uint32_t)at << 24) ^ (uint32_t)len);
+}
+
+void *editorJournalThread(void *arg) {
+  struct journal *j = arg;
+  char *out = NULL;
+  int outcap = 0;
+
+  pthread_mutex_lock(&j->lock);
+  while (1) {
+    while (j->len == 0 && !j->stop)
+      pthread_cond_wait(&j->cond, &j->lock);
+    if (j->len == 0) break;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += NOTEC_JOURNAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (!j->stop &&
+           pthread_cond_timedwait(&j->cond, &j->lock, &deadline) == 0);
+
+    char *data = j->buf;
+    int len = j->len, cap = j->cap, reset = j->reset;
+    j->buf = out;
+    j->cap = outcap;
+    j->len = 0;
+    j->reset = 0;
+    out = data;
+    outcap = cap;
+    pthread_mutex_unlock(&j->lock);
+
+    if (reset && ftruncate(j->fd, 0) == -1) len = 0;
+    for (int done = 0; done < len; ) {
+      ssize_t n = write(j->fd, &out[done], len - done);
+      if (n == -1 && errno != EINTR) break;
+      if (n > 0) done += n;
+    }
+    fdatasync(j->fd);
+
+    pthread_mutex_lock(&j->lock);
+  }
+  pthread_mutex_unlock(&j->lock);
+  free(out);
+  return NULL;
+}
+
+int editorJournalStart(int flags) {
+  struct journal *j = &E.cur->journal;
+  if (j->path == NULL)
+    j->path = editorSidecarPath(E.cur->filename, "notec-journal");
+  j->fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags,
+               0600);
+  if (j->fd == -1) {
+    j->failed = 1;
+    editorSetStatusMessage("No recovery journal: %s", strerror(errno));
+    return 0;
+  }
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->cond, NULL);
+  if (pthread_create(&j->thread, NULL, editorJournalThread, j) != 0)
+    die("pthread_create");
+  j->running = 1;
+  return 1;
+}
+
+int editorJournalOpen() {
+  struct journal *j = &E.cur->journal;
+  if (j->fd != -1) return 1;
+  if (j->failed || j->paused || E.cur->filename == NULL) return 0;
+  if (!editorJournalStart(O_TRUNC)) return 0;
+  pthread_mutex_lock(&j->lock);
+  editorJournalHeader();
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+  return 1;
+}
+
+void editorJournalRecord(int type, int32_t at, const char *s, int32_t len) {
+  struct journal *j = &E.cur->journal;
+  uint8_t t = type;
+  uint32_t sum = editorJournalSum(type, at, s, len);
+  pthread_mutex_lock(&j->lock);
+  editorJournalPut(&t, 1);
+  editorJournalPut(&at, 4);
+  editorJournalPut(&len, 4);
+  editorJournalPut(&sum, 4);
+  editorJournalPut(s, len);
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void editorJournalFlush() {
+  int at = E.cur->journal.pending;
+  E.cur->journal.pending = -1;
+  if (at == -1 || at >= E.cur->numrows || E.cur->journal.fd == -1) return;
+  editorJournalRecord('S', at, E.cur->row[at].chars, E.cur->row[at].size);
+}
+
+void editorJournalRow(int at) {
+  if (E.cur->journal.paused || !editorJournalOpen()) return;
+  if (E.cur->journal.pending != at) editorJournalFlush();
+  E.cur->journal.pending = at;
+}
+
+void editorJournalInsert(int at, char *s, int len) {
+  if (E.cur->journal.paused || !editorJournalOpen()) return;
+  editorJournalFlush();
+  editorJournalRecord('I', at, s, len);
+}
+
+void editorJournalDelete(int at) {
+  if (E.cur->journal.paused || !editorJournalOpen()) return;
+  editorJournalFlush();
+  editorJournalRecord('D', at, "", 0);
+}
+
+void editorJournalReset() {
+  struct journal *j = &E.cur->journal;
+  j->pending = -1;
+  if (j->fd == -1) return;
+  pthread_mutex_lock(&j->lock);
+  j->len = 0;
+  editorJournalHeader();
+  j->reset = 1;
+  pthread_cond_signal(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void editorJournalClose() {
+  struct journal *j = &E.cur->journal;
+  if (j->running) {
+    pthread_mutex_lock(&j->lock);
+    j->stop = 1;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->thread, NULL);
+    j->running = 0;
+  }
+  if (j->fd != -1) {
+    close(j->fd);
+    unlink(j->path);
+    j->fd = -1;
+  }
+}
+
+int editorJournalNext(char *buf, int len, int *off, int *type, int32_t *at,
+                      char **s, int32_t *slen) {
+  uint32_t sum;
+  if (len - *off < 13) return 0;
+  char *p = &buf[*off];
+  *type = (uint8_t)p[0];
+  memcpy(at, &p[1], 4);
+  memcpy(slen, &p[5], 4);
+  memcpy(&sum, &p[9], 4);
+  if (*slen < 0 || *slen > len - *off - 13) return 0;
+  *s = &p[13];
+  if (sum != editorJournalSum(*type, *at, *s, *slen)) return 0;
+  *off += 13 + *slen;
+  return 1;
+}
+
+void editorJournalApply(int type, int at, char *s, int len) {
+  if (type == 'I') {
+    editorInsertRow(at, s, len);
+  } else if (type == 'D') {
+    editorDelRow(at);
+  } else if (type == 'S' && at >= 0 && at < E.cur->numrows) {
+    char *chars = malloc(len + 1);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    free(editorRowSwapChars(&E.cur->row[at], chars, len));
+  }
+}
+
+void editorJournalRecover() {
+  struct journal *j = &E.cur->journal;
+  if (j->checked || E.cur->stream.fd != -1 || E.cur->filename == NULL ||
+      E.cur->pager.active || E.cur->hex.active) return;
+  j->checked = 1;
+  j->path = editorSidecarPath(E.cur->filename, "notec-journal");
+
+  int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return;
+  int len = 0, cap = 4096;
+  char *buf = malloc(cap);
+  ssize_t n;
+  while ((n = read(fd, &buf[len], cap - len)) > 0) {
+    len += n;
+    if (len == cap) buf = realloc(buf, cap *= 2);
+  }
+  close(fd);
+
+  int off = 32, records = 0, type;
+  int32_t at, slen;
+  uint32_t version;
+  char *s;
+  if (len < 32 || memcmp(buf, "NJNL", 4) != 0) {
+    free(buf);
+    return;
+  }
+  memcpy(&version, &buf[4], 4);
+  if (version != NOTEC_JOURNAL_VERSION) {
+    free(buf);
+    editorSetStatusMessage("Ignoring a recovery journal of version %u",
+                           (unsigned)version);
+    return;
+  }
+  while (editorJournalNext(buf, len, &off, &type, &at, &s, &slen)) records++;
+  if (records == 0) {
+    unlink(j->path);
+    free(buf);
+    return;
+  }
+
+  int64_t stamp[3];
+  memcpy(stamp, &buf[8], sizeof(stamp));
+  int moved = stamp[0] != E.cur->disk.stamp.size ||
+              stamp[1] != E.cur->disk.stamp.mtime.tv_sec ||
+              stamp[2] != E.cur->disk.stamp.mtime.tv_nsec;
+  if (!editorConfirm(moved ?
+        "Recover %d edit%s? The file changed since they were made (y/n)" :
+        "Recover %d unsaved edit%s from the journal? (y/n)",
+        records, records == 1 ? "" : "s")) {
+    unlink(j->path);
+    free(buf);
+    editorSetStatusMessage("Discarded the recovery journal");
+    return;
+  }
+
+  int valid = off;
+  off = 32;
+  j->paused++;
+  while (editorJournalNext(buf, len, &off, &type, &at, &s, &slen))
+    editorJournalApply(type, at, s, slen);
+  j->paused--;
+  free(buf);
+
+  if (editorJournalStart(0) && ftruncate(j->fd, valid) == -1)
+    editorSetStatusMessage("Can't trim the journal: %s", strerror(errno));
+  else
+    editorSetStatusMessage("Recovered %d edit%s; save to keep them", records,
+                           records == 1 ? "" : "s");
+}
+
+/*** undo ***/
+
+void editorUndoFree(struct undoBatch *b) {
+  for (int k = 0; k < b->n; k++) free(b->chars[k]);
+  free(b->rows);
+  free(b->chars);
+  free(b->sizes);
+  free(b->after);
+  memset(b, 0, sizeof(*b));
+}
+
+void editorUndoSaveRow(struct undoBatch *b, int at, char *chars, int size) {
+  if (b->n == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 64;
+    b->rows = realloc(b->rows, sizeof(int) * b->cap);
+    b->chars = realloc(b->chars, sizeof(char *) * b->cap);
+    b->sizes = realloc(b->sizes, sizeof(int) * b->cap);
+    b->after = realloc(b->after, sizeof(uint64_t) * b->cap);
+  }
+  b->rows[b->n] = at;
+  b->chars[b->n] = chars;
+  b->sizes[b->n] = size;
+  b->after[b->n] = editorRowHash(&E.cur->row[at]);
+  b->n++;
+}
+
+void editorUndoPush(struct undoBatch *b) {
+  if (E.cur->nundo == NOTEC_UNDO_MAX) {
+    editorUndoFree(&E.cur->undo[0]);
+    memmove(&E.cur->undo[0], &E.cur->undo[1],
+            sizeof(E.cur->undo[0]) * (NOTEC_UNDO_MAX - 1));
+    E.cur->nundo--;
+  }
+  E.cur->undo[E.cur->nundo++] = *b;
+}
+
+/* Batch rows are saved in ascending order, so only the tail past an
+ * insertion or deletion point has to move. A batch that loses one of its
+ * rows can no longer be undone. */
+int editorUndoFind(struct undoBatch *b, int at) {
+  int lo = 0, hi = b->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (b->rows[mid] < at) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+void editorUndoInsertRows(int at, int n) {
+  if (n <= 0) return;
+  for (int i = 0; i < E.cur->nundo; i++) {
+    struct undoBatch *b = &E.cur->undo[i];
+    if (b->cy >= at) b->cy += n;
+    if (b->lost) continue;
+    for (int k = editorUndoFind(b, at); k < b->n; k++) b->rows[k] += n;
+  }
+}
+
+void editorUndoDeleteRows(int at, int n) {
+  if (n <= 0) return;
+  for (int i = 0; i < E.cur->nundo; i++) {
+    struct undoBatch *b = &E.cur->undo[i];
+    if (b->cy >= at + n) b->cy -= n;
+    else if (b->cy > at) b->cy = at;
+    if (b->lost) continue;
+    int k = editorUndoFind(b, at);
+    if (k < b->n && b->rows[k] < at + n) {
+      b->lost = 1;
+      continue;
+    }
+    for (; k < b->n; k++) b->rows[k] -= n;
+  }
+}
+
+void editorUndo() {
+  if (E.cur->nundo == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  struct undoBatch *b = &E.cur->undo[E.cur->nundo - 1];
+  if (b->lost) {
+    editorSetStatusMessage("Can't undo: those lines were deleted since");
+    return;
+  }
+  for (int k = 0; k < b->n; k++) {
+    int at = b->rows[k];
+    if (at >= E.cur->numrows || editorRowHash(&E.cur->row[at]) != b->after[k]) {
+      editorSetStatusMessage("Can't undo: those lines were edited since");
+      return;
+    }
+  }
+
+  E.hl_defer++;
+  for (int k = 0; k < b->n; k++) {
+    free(editorRowSwapChars(&E.cur->row[b->rows[k]], b->chars[k], b->sizes[k]));
+    b->chars[k] = NULL;
+  }
+  E.hl_defer--;
+  if (b->n) editorUpdateSyntaxRange(b->rows[0], b->rows[b->n - 1]);
+
+  E.cx = b->cx;
+  E.cy = b->cy;
+  editorSetStatusMessage("Undid changes to %d line%s", b->n,
+                         b->n == 1 ? "" : "s");
+  editorUndoFree(b);
+  E.cur->nundo--;
+}
+
+/*** multiple cursors ***/
+
+void editorCursorsClear() {
+  E.cur->cursors.n = 0;
+  E.cur->block.active = 0;
+  E.cur->sel.active = 0;
+}
+
+int editorCursorFind(int filerow) {
+  int lo = 0, hi = E.cur->cursors.n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.cur->cursors.rows[mid] < filerow) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < E.cur->cursors.n && E.cur->cursors.rows[lo] == filerow ? lo : -1;
+}
+
+void editorCursorAdd() {
+  struct cursorSet *cs = &E.cur->cursors;
+  if (E.cy >= E.cur->numrows) return;
+  E.cur->block.active = 0;
+  int bottom = cs->n ? cs->rows[cs->n - 1] : E.cy;
+  if (bottom < E.cy) bottom = E.cy;
+  if (bottom + 1 >= E.cur->numrows) {
+    editorSetStatusMessage("No line below for another cursor");
+    return;
+  }
+  if (cs->n == cs->cap) {
+    cs->cap = cs->cap ? cs->cap * 2 : 64;
+    cs->rows = realloc(cs->rows, sizeof(int) * cs->cap);
+    cs->cols = realloc(cs->cols, sizeof(int) * cs->cap);
+  }
+  erow *row = &E.cur->row[bottom + 1];
+  int rx = editorRowCxToRx(&E.cur->row[E.cy], E.cx);
+  cs->rows[cs->n] = bottom + 1;
+  cs->cols[cs->n] = editorRowRxToCx(row, rx);
+  cs->n++;
+  editorSetStatusMessage("%d cursors (ESC to drop)", cs->n + 1);
+}
+
+void editorToggleBlock() {
+  E.cur->cursors.n = 0;
+  E.cur->block.active = !E.cur->block.active;
+  if (!E.cur->block.active) return;
+  E.cur->block.cy = E.cy;
+  E.cur->block.rx = E.cy < E.cur->numrows
+                      ? editorRowCxToRx(&E.cur->row[E.cy], E.cx) : 0;
+  editorSetStatusMessage("Block selection: move to extend, type to edit");
+}
+
+void editorBlockBounds(int *top, int *bottom, int *left, int *right) {
+  int rx = E.cy < E.cur->numrows ? editorRowCxToRx(&E.cur->row[E.cy], E.cx) : 0;
+  *top = E.cur->block.cy < E.cy ? E.cur->block.cy : E.cy;
+  *bottom = E.cur->block.cy < E.cy ? E.cy : E.cur->block.cy;
+  if (*bottom >= E.cur->numrows) *bottom = E.cur->numrows - 1;
+  *left = E.cur->block.rx < rx ? E.cur->block.rx : rx;
+  *right = E.cur->block.rx < rx ? rx : E.cur->block.rx;
+}
+
+void editorBlockRowRange(erow *row, int left, int right, int *from, int *to) {
+  *from = editorRowRxToCx(row, left);
+  *to = editorRowRxToCx(row, right);
+  if (right > left && *from == *to && *from < row->size)
+    *to = editorRowNextChar(row, *from);
+}
+
+void editorCursorsMove(int key) {
+  for (int k = 0; k < E.cur->cursors.n; k++) {
+    if (E.cur->cursors.rows[k] >= E.cur->numrows) continue;
+    erow *row = &E.cur->row[E.cur->cursors.rows[k]];
+    int *cx = &E.cur->cursors.cols[k];
+    if (*cx > row->size) *cx = row->size;
+    switch (key) {
+      case ARROW_LEFT: *cx = editorRowPrevChar(row, *cx); break;
+      case ARROW_RIGHT: *cx = editorRowNextChar(row, *cx); break;
+      case HOME_KEY: *cx = 0; break;
+      case END_KEY: *cx = row->size; break;
+    }
+  }
+}
+
+void editorCursorsEdit(int key) {
+  int n = 0, cap = E.cur->cursors.n + 1;
+  int top = 0, bottom = -1, left = 0, right = 0;
+  if (E.cur->block.active) {
+    editorBlockBounds(&top, &bottom, &left, &right);
+    cap = bottom - top + 1;
+  }
+  if (cap <= 0) return;
+  int *rows = malloc(sizeof(int) * cap);
+  int *from = malloc(sizeof(int) * cap);
+  int *to = malloc(sizeof(int) * cap);
+
+  if (E.cur->block.active) {
+    for (int j = top; j <= bottom; j++) {
+      erow *row = &E.cur->row[j];
+      if (row->rwidth < left) continue;
+      rows[n] = j;
+      editorBlockRowRange(row, left, right, &from[n], &to[n]);
+      n++;
+    }
+  } else {
+    int primary = E.cy < E.cur->numrows;
+    int k = 0;
+    while (primary || k < E.cur->cursors.n) {
+      int at, cx;
+      if (primary &&
+          (k == E.cur->cursors.n || E.cur->cursors.rows[k] >= E.cy)) {
+        at = E.cy;
+        cx = E.cx;
+        primary = 0;
+      } else {
+        at = E.cur->cursors.rows[k];
+        cx = E.cur->cursors.cols[k++];
+        if (at == E.cy || at >= E.cur->numrows) continue;
+      }
+      if (cx > E.cur->row[at].size) cx = E.cur->row[at].size;
+      rows[n] = at;
+      from[n] = to[n] = editorRowCharStart(&E.cur->row[at], cx);
+      n++;
+    }
+  }
+
+  char ch = key;
+  int len = (key == BACKSPACE || key == CTRL_KEY('h') || key == DEL_KEY) ? 0 : 1;
+  E.hl_defer++;
+  for (int k = 0; k < n; k++) {
+    erow *row = &E.cur->row[rows[k]];
+    if (from[k] == to[k] && len == 0) {
+      if (right > left) continue;
+      if (key == DEL_KEY) to[k] = editorRowNextChar(row, to[k]);
+      else from[k] = editorRowPrevChar(row, from[k]);
+      if (from[k] == to[k]) continue;
+    }
+    editorRowSplice(row, from[k], to[k], &ch, len);
+    from[k] += len;
+  }
+  E.hl_defer--;
+
+  if (n) editorUpdateSyntaxRange(rows[0], rows[n - 1]);
+  int c = 0;
+  for (int k = 0; k < n; k++) {
+    if (rows[k] == E.cy) {
+      E.cx = from[k];
+    } else if (!E.cur->block.active) {
+      E.cur->cursors.rows[c] = rows[k];
+      E.cur->cursors.cols[c++] = from[k];
+    }
+  }
+  if (!E.cur->block.active) E.cur->cursors.n = c;
+  else if (E.cy < E.cur->numrows)
+    E.cur->block.rx = editorRowCxToRx(&E.cur->row[E.cy], E.cx);
+  free(rows);
+  free(from);
+  free(to);
+}
+
+int editorRowMark(int filerow, int *m0, int *m1) {
+  erow *row = &E.cur->row[filerow];
+  int from, to;
+  if (E.cur->sel.active) {
+    int y0, x0, y1, x1;
+    editorSelectionBounds(&y0, &x0, &y1, &x1);
+    if (filerow < y0 || filerow > y1) return 0;
+    from = filerow == y0 ? x0 : 0;
+    to = filerow == y1 ? x1 : row->size;
+    if (from == to) return 0;
+  } else if (E.cur->block.active) {
+    int top, bottom, left, right;
+    editorBlockBounds(&top, &bottom, &left, &right);
+    if (filerow < top || filerow > bottom || row->rwidth < left) return 0;
+    editorBlockRowRange(row, left, right, &from, &to);
+  } else if (E.cur->cursors.n) {
+    int k = editorCursorFind(filerow);
+    if (k == -1 || filerow == E.cy) return 0;
+    from = to = E.cur->cursors.cols[k] < row->size ? E.cur->cursors.cols[k]
+                                                   : row->size;
+  } else if (filerow == E.cur->brackets.mrow) {
+    from = to = editorRowRiToCx(row, E.cur->brackets.mri);
+  } else {
+    return 0;
+  }
+  if (from == to) {
+    to = editorRowNextChar(row, from);
+    if (from == row->size) {
+      *m0 = row->rsize;
+      *m1 = row->rsize + 1;
+      return 1;
+    }
+  }
+  *m0 = editorRowCxToRi(row, from);
+  *m1 = editorRowCxToRi(row, to);
+  return 1;
+}
+
+/*** clipboard ***/
+
+void editorToggleMark() {
+  int active = E.cur->sel.active;
+  editorCursorsClear();
+  E.cur->sel.active = !active && E.cy < E.cur->numrows;
+  E.cur->sel.cy = E.cy;
+  E.cur->sel.cx = E.cx;
+  if (E.cur->sel.active) editorSetStatusMessage("Mark set");
+}
+
+void editorSelectionBounds(int *y0, int *x0, int *y1, int *x1) {
+  int cy = E.cy, cx = E.cx;
+  if (cy >= E.cur->numrows) {
+    cy = E.cur->numrows - 1;
+    cx = E.cur->row[cy].size;
+  }
+  int sy = E.cur->sel.cy < E.cur->numrows ? E.cur->sel.cy : E.cur->numrows - 1;
+  int sx = E.cur->sel.cx < E.cur->row[sy].size ? E.cur->sel.cx
+                                                : E.cur->row[sy].size;
+  if (sy < cy || (sy == cy && sx < cx)) {
+    *y0 = sy; *x0 = sx; *y1 = cy; *x1 = cx;
+  } else {
+    *y0 = cy; *x0 = cx; *y1 = sy; *x1 = sx;
+  }
+}
+
+void editorRegisterClear(struct textRegister *r) {
+  if (r->buf) editorTextRelease(r->buf);
+  r->buf = NULL;
+  r->n = 0;
+}
+
+/* A copy is one allocation: the lines go into a NUL-separated chunk that
+ * pasted rows point into, so it is held once however often it is pasted.
+ * The source rows keep their own storage. */
+void editorRegisterFill(struct textRegister *r, int y0, int x0, int y1,
+                        int x1) {
+  size_t total = 0;
+  for (int j = y0; j <= y1; j++) total += E.cur->row[j].size + 1;
+  if (y1 - y0 + 1 > r->cap) {
+    r->cap = y1 - y0 + 1;
+    r->slices = realloc(r->slices, sizeof(struct textSlice) * r->cap);
+  }
+  r->buf = malloc(sizeof(struct textBuf));
+  r->buf->refs = 1;
+  r->buf->data = malloc(total);
+  size_t off = 0;
+  for (int j = y0; j <= y1; j++) {
+    erow *row = &E.cur->row[j];
+    int from = j == y0 ? x0 : 0, to = j == y1 ? x1 : row->size;
+    struct textSlice *sl = &r->slices[r->n++];
+    sl->off = off;
+    sl->len = to - from;
+    memcpy(&r->buf->data[off], &row->chars[from], sl->len);
+    off += sl->len;
+    r->buf->data[off++] = '\0';
+  }
+}
+
+void editorCopySelection(int cut) {
+  if (E.cur->numrows == 0) return;
+  int y0, x0, y1, x1;
+  editorSelectionBounds(&y0, &x0, &y1, &x1);
+  E.cur->sel.active = 0;
+
+  struct textRegister *r = &E.reg;
+  editorRegisterClear(r);
+  editorRegisterFill(r, y0, x0, y1, x1);
+  editorSetStatusMessage("%s %d line%s", cut ? "Cut" : "Copied", r->n,
+                         r->n == 1 ? "" : "s");
+  if (!cut) return;
+
+  if (y0 == y1) {
+    editorRowSplice(&E.cur->row[y0], x0, x1, "", 0);
+  } else {
+    erow *last = &E.cur->row[y1];
+    int len = x0 + last->size - x1;
+    char *line = malloc(len + 1);
+    memcpy(line, E.cur->row[y0].chars, x0);
+    memcpy(&line[x0], &last->chars[x1], last->size - x1);
+    E.hl_defer++;
+    editorReplaceRows(y0, y1 - y0 + 1, &line, &len, 1, NULL);
+    E.hl_defer--;
+    editorUpdateSyntaxRange(y0, y0);
+    free(line);
+  }
+  E.cy = y0;
+  E.cx = x0;
+}
+
+void editorPaste() {
+  struct textRegister *r = &E.reg;
+  if (r->n == 0) {
+    editorSetStatusMessage("Nothing to paste");
+    return;
+  }
+  if (E.cy == E.cur->numrows) editorInsertRow(E.cur->numrows, "", 0);
+  erow *row = &E.cur->row[E.cy];
+  char *data = r->buf->data;
+  struct textSlice *first = &r->slices[0], *last = &r->slices[r->n - 1];
+  if (r->n == 1) {
+    editorRowSplice(row, E.cx, E.cx, &data[first->off], first->len);
+    E.cx += first->len;
+    return;
+  }
+
+  char **lines = malloc(sizeof(char *) * r->n);
+  int *lens = malloc(sizeof(int) * r->n);
+  struct textBuf **shared = malloc(sizeof(struct textBuf *) * r->n);
+  for (int k = 1; k < r->n - 1; k++) {
+    lines[k] = &data[r->slices[k].off];
+    lens[k] = r->slices[k].len;
+    shared[k] = r->buf;
+  }
+  int tail = row->size - E.cx;
+  lens[0] = E.cx + first->len;
+  lines[0] = malloc(lens[0]);
+  memcpy(lines[0], row->chars, E.cx);
+  memcpy(&lines[0][E.cx], &data[first->off], first->len);
+  lens[r->n - 1] = last->len + tail;
+  lines[r->n - 1] = malloc(lens[r->n - 1]);
+  memcpy(lines[r->n - 1], &data[last->off], last->len);
+  memcpy(&lines[r->n - 1][last->len], &row->chars[E.cx], tail);
+  shared[0] = shared[r->n - 1] = NULL;
+
+  E.hl_defer++;
+  editorReplaceRows(E.cy, 1, lines, lens, r->n, shared);
+  E.hl_defer--;
+  editorUpdateSyntaxRange(E.cy, E.cy + r->n - 1);
+  editorSetStatusMessage("Pasted %d lines", r->n);
+  E.cy += r->n - 1;
+  E.cx = last->len;
+  free(lines[0]);
+  free(lines[r->n - 1]);
+  free(lines);
+  free(lens);
+  free(shared);
+}
+
+/*** filter ***/
+
+/* Reads only the row's chars, expanding into *buf, so it is safe to call
+ * from the filter workers. */
+int editorFilterMatch(erow *row, char **buf, int *cap) {
+  const char *text = row->chars;
+  int len = row->size;
+  if (row->needmap) {
+    if (*cap < row->size * NOTEC_TAB_STOP + 1) {
+      *cap = row->size * NOTEC_TAB_STOP + 1;
+      *buf = realloc(*buf, *cap);
+    }
+    len = editorExpandChars(row->chars, row->size, *buf, NULL, NULL, NULL);
+    text = *buf;
+  }
+  return memmem(text, len, E.cur->filter.pattern, E.cur->filter.len) != NULL;
+}
+
+int editorFilterFind(int filerow) {
+  int lo = 0, hi = E.cur->filter.n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.cur->filter.rows[mid] < filerow) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+void editorFilterInsertAt(int pos, int filerow) {
+  struct rowFilter *f = &E.cur->filter;
+  if (f->n == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 1024;
+    f->rows = realloc(f->rows, sizeof(int) * f->cap);
+  }
+  memmove(&f->rows[pos + 1], &f->rows[pos], sizeof(int) * (f->n - pos));
+  f->rows[pos] = filerow;
+  f->n++;
+}
+
+void editorFilterInsertRows(int at, int n) {
+  if (!E.cur->filter.active) return;
+  for (int k = editorFilterFind(at); k < E.cur->filter.n; k++)
+    E.cur->filter.rows[k] += n;
+}
+
+void editorFilterDeleteRows(int at, int n) {
+  struct rowFilter *f = &E.cur->filter;
+  if (!f->active || n == 0) return;
+  int lo = editorFilterFind(at), hi = editorFilterFind(at + n);
+  memmove(&f->rows[lo], &f->rows[hi], sizeof(int) * (f->n - hi));
+  f->n -= hi - lo;
+  for (int k = lo; k < f->n; k++) f->rows[k] -= n;
+}
+
+void editorFilterRowUpdated(erow *row) {
+  struct rowFilter *f = &E.cur->filter;
+  int pos = editorFilterFind(row->idx);
+  int present = pos < f->n && f->rows[pos] == row->idx;
+  char *buf = NULL;
+  int cap = 0;
+  int match = editorFilterMatch(row, &buf, &cap);
+  free(buf);
+  if (match && !present) {
+    editorFilterInsertAt(pos, row->idx);
+  } else if (!match && present) {
+    memmove(&f->rows[pos], &f->rows[pos + 1], sizeof(int) * (f->n - pos - 1));
+    f->n--;
+  }
+}
+
+void *editorFilterThread(void *arg) {
+  struct filterJob *job = arg;
+  char *buf = NULL;
+  int cap = 0;
+  for (int j = job->from; j < job->to; j++) {
+    if (!editorFilterMatch(&E.cur->row[j], &buf, &cap)) continue;
+    if (job->n == job->cap) {
+      job->cap = job->cap ? job->cap * 2 : 1024;
+      job->rows = realloc(job->rows, sizeof(int) * job->cap);
+    }
+    job->rows[job->n++] = j;
+  }
+  free(buf);
+  return NULL;
+}
+
+void editorFilterBuild() {
+  struct rowFilter *f = &E.cur->filter;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = E.cur->numrows < 65536 || cpus < 1 ? 1 : cpus > 8 ? 8 : cpus;
+  struct filterJob jobs[8];
+  memset(jobs, 0, sizeof(jobs));
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t].from = (long long)E.cur->numrows * t / nthreads;
+    jobs[t].to = (long long)E.cur->numrows * (t + 1) / nthreads;
+  }
+  for (int t = 1; t < nthreads; t++) {
+    if (pthread_create(&jobs[t].thread, NULL, editorFilterThread, &jobs[t]) != 0)
+      die("pthread_create");
+  }
+  editorFilterThread(&jobs[0]);
+
+  f->n = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (t > 0) pthread_join(jobs[t].thread, NULL);
+    if (f->n + jobs[t].n > f->cap) {
+      f->cap = f->n + jobs[t].n;
+      f->rows = realloc(f->rows, sizeof(int) * f->cap);
+    }
+    if (jobs[t].n) memcpy(&f->rows[f->n], jobs[t].rows, sizeof(int) * jobs[t].n);
+    f->n += jobs[t].n;
+    free(jobs[t].rows);
+  }
+}
+
+void editorFilter() {
+  char *pattern = editorPrompt("Filter: %s (ESC to show all)", NULL);
+  struct rowFilter *f = &E.cur->filter;
+  free(f->pattern);
+  f->pattern = NULL;
+  f->active = 0;
+  if (pattern == NULL || pattern[0] == '\0') {
+    free(pattern);
+    editorSetStatusMessage("Filter cleared");
+    return;
+  }
+  f->pattern = pattern;
+  f->len = strlen(pattern);
+  f->off = 0;
+  f->active = 1;
+  editorFilterBuild();
+  if (f->n) {
+    int pos = editorFilterFind(E.cy);
+    E.cy = f->rows[pos < f->n ? pos : f->n - 1];
+    E.cx = 0;
+  }
+  editorSetStatusMessage("%d matching line%s", f->n, f->n == 1 ? "" : "s");
+}
+
+int editorViewStep(int filerow, int delta) {
+  struct rowFilter *f = &E.cur->filter;
+  if (!f->active) {
+    int v = editorRowToVisible(filerow) + delta;
+    if (v < 0) v = 0;
+    if (v > editorRowToVisible(E.cur->numrows))
+      v = editorRowToVisible(E.cur->numrows);
+    return editorVisibleToRow(v);
+  }
+  if (f->n == 0) return filerow;
+  int pos = editorFilterFind(filerow);
+  if (delta > 0 && (pos == f->n || f->rows[pos] != filerow)) pos--;
+  pos += delta;
+  if (pos < 0) pos = 0;
+  if (pos >= f->n) pos = f->n - 1;
+  return f->rows[pos];
+}
+
+/* A cursor row that doesn't match is shown in place until the cursor leaves
+ * it, without being added to the filtered rows. */
+int editorFilterExtra() {
+  struct rowFilter *f = &E.cur->filter;
+  if (E.cy >= E.cur->numrows) return -1;
+  int pos = editorFilterFind(E.cy);
+  return pos < f->n && f->rows[pos] == E.cy ? -1 : E.cy;
+}
+
+int editorFilterRow(int k) {
+  struct rowFilter *f = &E.cur->filter;
+  int extra = editorFilterExtra();
+  if (extra != -1) {
+    int pos = editorFilterFind(extra);
+    if (k == pos) return extra;
+    if (k > pos) k--;
+  }
+  return k < f->n ? f->rows[k] : -1;
+}
+
+void editorFilterScroll() {
+  struct rowFilter *f = &E.cur->filter;
+  if (E.cy >= E.cur->numrows && E.cur->numrows > 0) {
+    E.cy = f->n ? f->rows[f->n - 1] : E.cur->numrows - 1;
+    E.cx = 0;
+  }
+  int pos = editorFilterFind(E.cy);
+  if (pos < f->off) f->off = pos;
+  if (pos >= f->off + E.screenrows) f->off = pos - E.screenrows + 1;
+  if (E.rx < E.coloff) E.coloff = E.rx;
+  if (E.rx >= E.coloff + E.screencols) E.coloff = E.rx - E.screencols + 1;
+}
+
+/*** search index ***/
+
+uint32_t editorTrigramHash(const unsigned char *t) {
+  return ((uint32_t)t[0] << 16 | t[1] << 8 | t[2]) * 0x9E3779B1u;
+}
+
+void editorBloomAdd(struct triBlock *b, uint32_t h) {
+  uint32_t h2 = (h >> 16 | h << 16) * 0x85EBCA6Bu;
+  b->bloom[(h & b->mask) >> 3] |= 1 << (h & 7);
+  b->bloom[(h2 & b->mask) >> 3] |= 1 << (h2 & 7);
+}
+
+int editorBloomHas(struct triBlock *b, uint32_t h) {
+  uint32_t h2 = (h >> 16 | h << 16) * 0x85EBCA6Bu;
+  return (b->bloom[(h & b->mask) >> 3] & 1 << (h & 7)) &&
+         (b->bloom[(h2 & b->mask) >> 3] & 1 << (h2 & 7));
+}
+
+void editorBloomAddRow(struct triBlock *b, const char *text, int len) {
+  const unsigned char *r = (const unsigned char *)text;
+  for (int i = 0; i + 3 <= len; i++)
+    editorBloomAdd(b, editorTrigramHash(&r[i]));
+}
+
+long long editorIndexBlockSize(int b) {
+  int rows = E.cur->numrows - b * NOTEC_INDEX_BLOCK;
+  return rows < NOTEC_INDEX_BLOCK ? rows : NOTEC_INDEX_BLOCK;
+}
+
+void editorIndexFreeBlocks() {
+  for (int b = 0; b < E.cur->index.nblocks; b++)
+    free(E.cur->index.blocks[b].bloom);
+  E.cur->index.nblocks = 0;
+  E.cur->index.unbuilt = 0;
+  E.cur->index.next = 0;
+}
+
+void editorIndexReset() {
+  struct triIndex *x = &E.cur->index;
+  editorIndexFreeBlocks();
+  x->nblocks = (E.cur->numrows + NOTEC_INDEX_BLOCK - 1) / NOTEC_INDEX_BLOCK;
+  if (x->nblocks > x->cap) {
+    x->cap = x->nblocks;
+    x->blocks = realloc(x->blocks, sizeof(struct triBlock) * x->cap);
+  }
+  memset(x->blocks, 0, sizeof(struct triBlock) * x->nblocks);
+  x->unbuilt = x->nblocks;
+  fenwickBuild(&x->rows, x->nblocks, editorIndexBlockSize);
+}
+
+int editorIndexBlockRows(int b, int *first) {
+  *first = fenwickPrefix(&E.cur->index.rows, b);
+  return fenwickPrefix(&E.cur->index.rows, b + 1) - *first;
+}
+
+int editorIndexBlockOf(int at, int *first, int *count) {
+  long long off = at;
+  int b = E.cur->index.nblocks ? fenwickFind(&E.cur->index.rows, &off) : 0;
+  if (b >= E.cur->index.nblocks) b = E.cur->index.nblocks - 1;
+  int start;
+  int rows = editorIndexBlockRows(b, &start);
+  if (first) *first = start;
+  if (count) *count = rows;
+  return b;
+}
+
+void editorIndexAllocBlock(struct triBlock *b, int bytes) {
+  uint32_t bits = 512;
+  while (bits < (uint32_t)bytes * 4 && bits < (1u << 24)) bits *= 2;
+  b->mask = bits - 1;
+  b->bloom = calloc(bits / 8, 1);
+}
+
+void editorIndexBuildBlock(int b) {
+  int first, bytes = 0;
+  struct triBlock *blk = &E.cur->index.blocks[b];
+  int count = editorIndexBlockRows(b, &first);
+  for (int j = first; j < first + count; j++) bytes += E.cur->row[j].rsize;
+  free(blk->bloom);
+  editorIndexAllocBlock(blk, bytes);
+  char *buf = NULL;
+  int cap = 0;
+  for (int j = first; j < first + count; j++)
+    editorBloomAddRow(blk, editorRowText(&E.cur->row[j], &buf, &cap),
+                      E.cur->row[j].rsize);
+  free(buf);
+}
+
+void editorIndexInsertRows(int at, int n) {
+  struct triIndex *x = &E.cur->index;
+  if (!x->enabled || n <= 0) return;
+  int total = fenwickPrefix(&x->rows, x->nblocks);
+  int count = 0;
+  int b = x->nblocks ? editorIndexBlockOf(at < total ? at : total - 1,
+                                          NULL, &count) : -1;
+  if (at < total || (b >= 0 && count + n <= NOTEC_INDEX_BLOCK)) {
+    fenwickAdd(&x->rows, b, n);
+    if (count + n > 4 * NOTEC_INDEX_BLOCK) x->relayout = 1;
+    return;
+  }
+  while (n > 0) {
+    if (x->nblocks == x->cap) {
+      x->cap = x->cap ? x->cap * 2 : 64;
+      x->blocks = realloc(x->blocks, sizeof(struct triBlock) * x->cap);
+    }
+    struct triBlock *blk = &x->blocks[x->nblocks++];
+    editorIndexAllocBlock(blk, NOTEC_INDEX_BLOCK * 80);
+    int rows = n < NOTEC_INDEX_BLOCK ? n : NOTEC_INDEX_BLOCK;
+    fenwickAppend(&x->rows, rows);
+    n -= rows;
+  }
+}
+
+void editorIndexDeleteRows(int at, int n) {
+  if (!E.cur->index.enabled) return;
+  while (n > 0 && E.cur->index.nblocks) {
+    int first, count;
+    int b = editorIndexBlockOf(at, &first, &count);
+    int del = first + count - at;
+    if (del > n) del = n;
+    if (del <= 0) break;
+    fenwickAdd(&E.cur->index.rows, b, -del);
+    n -= del;
+  }
+}
+
+void editorIndexRowUpdated(erow *row) {
+  if (E.cur->index.nblocks == 0) return;
+  int b = editorIndexBlockOf(row->idx, NULL, NULL);
+  if (E.cur->index.blocks[b].bloom)
+    editorBloomAddRow(&E.cur->index.blocks[b], row->render, row->rsize);
+}
+
+uint64_t editorIndexKey() {
+  return editorHash((const char *)E.cur->disk.hash,
+                    sizeof(uint64_t) * E.cur->disk.nhash);
+}
+
+void editorIndexSave() {
+  struct triIndex *x = &E.cur->index;
+  if (!x->enabled || x->unbuilt || x->relayout || E.cur->dirty ||
+      !E.cur->disk.valid)
+    return;
+  char *tmp;
+  if (asprintf(&tmp, "%s.%d", x->path, (int)getpid()) == -1) return;
+
+  FILE *fp = fopen(tmp, "wb");
+  if (fp) {
+    fwrite(NOTEC_INDEX_MAGIC, 1, 4, fp);
+    syntaxCacheWriteU32(fp, NOTEC_INDEX_VERSION);
+    syntaxCacheWriteI64(fp, (int64_t)editorIndexKey());
+    syntaxCacheWriteU32(fp, E.cur->numrows);
+    syntaxCacheWriteU32(fp, x->nblocks);
+    for (int b = 0; b < x->nblocks; b++) {
+      int first;
+      syntaxCacheWriteU32(fp, editorIndexBlockRows(b, &first));
+      syntaxCacheWriteU32(fp, x->blocks[b].mask);
+      fwrite(x->blocks[b].bloom, 1, (x->blocks[b].mask + 1) / 8, fp);
+    }
+    if (fclose(fp) == 0 && rename(tmp, x->path) == 0) {
+      free(tmp);
+      return;
+    }
+  }
+  unlink(tmp);
+  free(tmp);
+}
+
+int editorIndexLoad() {
+  struct triIndex *x = &E.cur->index;
+  if (!E.cur->disk.valid || E.cur->dirty) return 0;
+  int fd = open(x->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return 0;
+  struct stat st;
+  char *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+
+  struct syntaxCacheReader r = { map, map + st.st_size, 1 };
+  if (st.st_size < 4 || memcmp(map, NOTEC_INDEX_MAGIC, 4)) r.ok = 0;
+  r.p += 4;
+  if (syntaxCacheReadU32(&r) != NOTEC_INDEX_VERSION) r.ok = 0;
+  if ((uint64_t)syntaxCacheReadI64(&r) != editorIndexKey()) r.ok = 0;
+  if (syntaxCacheReadU32(&r) != (uint32_t)E.cur->numrows) r.ok = 0;
+  uint32_t nblocks = syntaxCacheReadU32(&r);
+
+  editorIndexFreeBlocks();
+  x->rows.n = 0;
+  x->rows.stale = 0;
+  for (uint32_t b = 0; b < nblocks && r.ok; b++) {
+    uint32_t count = syntaxCacheReadU32(&r);
+    uint32_t mask = syntaxCacheReadU32(&r);
+    size_t bytes = ((size_t)mask + 1) / 8;
+    if (!r.ok || (mask & (mask + 1)) || mask < 511 ||
+        (size_t)(r.end - r.p) < bytes) {
+      r.ok = 0;
+      break;
+    }
+    if (x->nblocks == x->cap) {
+      x->cap = x->cap ? x->cap * 2 : 64;
+      x->blocks = realloc(x->blocks, sizeof(struct triBlock) * x->cap);
+    }
+    struct triBlock *blk = &x->blocks[x->nblocks++];
+    blk->mask = mask;
+    blk->bloom = malloc(bytes);
+    memcpy(blk->bloom, r.p, bytes);
+    r.p += bytes;
+    fenwickAppend(&x->rows, count);
+  }
+  if (r.ok && fenwickPrefix(&x->rows, x->nblocks) != E.cur->numrows) r.ok = 0;
+  munmap(map, st.st_size);
+  return r.ok;
+}
+
+void editorIndexEnable() {
+  struct triIndex *x = &E.cur->index;
+  if (E.cur->filename == NULL || E.cur->pager.active || E.cur->hex.active)
+    return;
+  x->enabled = 1;
+  x->path = editorSidecarPath(E.cur->filename, "notec-index");
+  if (editorIndexLoad()) {
+    editorSetStatusMessage("Search index loaded");
+  } else {
+    editorIndexReset();
+  }
+}
+
+int editorIndexPending() {
+  return E.cur->index.enabled &&
+         (E.cur->index.unbuilt > 0 || E.cur->index.relayout);
+}
+
+int editorIndexStep() {
+  struct triIndex *x = &E.cur->index;
+  if (x->relayout) {
+    x->relayout = 0;
+    editorIndexReset();
+  }
+  long long start = editorNowMs();
+  while (x->unbuilt > 0) {
+    for (int k = 0; k < 16 && x->unbuilt > 0; k++) {
+      while (x->blocks[x->next].bloom) x->next++;
+      editorIndexBuildBlock(x->next);
+      x->unbuilt--;
+    }
+    if (editorNowMs() - start >= 8) return 0;
+  }
+  editorIndexSave();
+  editorSetStatusMessage("Search index ready");
+  return 1;
+}
+
+void editorIndexQuery(struct triQuery *q, const char *query) {
+  const unsigned char *u = (const unsigned char *)query;
+  int len = strlen(query);
+  q->n = 0;
+  for (int i = 0; i + 3 <= len && q->n < 32; i++) {
+    uint32_t h = editorTrigramHash(&u[i]);
+    int k = 0;
+    while (k < q->n && q->hash[k] != h) k++;
+    if (k == q->n) q->hash[q->n++] = h;
+  }
+}
+
+int editorIndexSkip(struct triQuery *q, int at, int direction) {
+  if (!E.cur->index.enabled || q->n == 0 || E.cur->index.relayout ||
+      E.cur->index.nblocks == 0) return 0;
+  int first, count;
+  int b = editorIndexBlockOf(at, &first, &count);
+  struct triBlock *blk = &E.cur->index.blocks[b];
+  if (blk->bloom == NULL) return 0;
+  for (int k = 0; k < q->n; k++) {
+    if (!editorBloomHas(blk, q->hash[k]))
+      return direction > 0 ? first + count - at : at - first + 1;
+  }
+  return 0;
+}
+
+/*** find ***/
+
+void editorFindCallback(char *query, int key) {
+  static int last_match = -1;
+  static int direction = 1;
 
   static int saved_hl_line;
   static char *saved_hl = NULL;
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+  if (saved_hl) {
+    if (E.cur->row[saved_hl_line].hl)
+      memcpy(E.cur->row[saved_hl_line].hl, saved_hl,
+             E.cur->row[saved_hl_line].rsize);
+    free(saved_hl);
+    saved_hl = NULL;
+  }
+
+  if (key == '\r' || key == '\x1b') {
+    last_match = -1;
+    direction = 1;
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    last_match = -1;
+    direction = 1;
+  }
+
+  if (last_match == -1) direction = 1;
+  int current = last_match;
+  struct triQuery q;
+  editorIndexQuery(&q, query);
+  char *buf = NULL;
+  int cap = 0;
+  int i;
+  for (i = 0; i < E.cur->numrows; i++) {
+    current += direction;
+    if (current == -1) current = E.cur->numrows - 1;
+    else if (current == E.cur->numrows) current = 0;
+
+    int skip = editorIndexSkip(&q, current, direction);
+    if (skip) {
+      i += skip - 1;
+      current += (skip - 1) * direction;
+      continue;
+    }
+
+    erow *row = &E.cur->row[current];
+    char *text = editorRowText(row, &buf, &cap);
+    char *match = strstr(text, query);
+    if (match) {
+      int ri = match - text;
+      last_match = current;
+      E.cy = current;
+      E.cx = editorRowRiToCx(row, ri);
+      E.rowoff = E.cur->numrows;
+
+      editorRowEnsure(row);
+      saved_hl_line = current;
+      saved_hl = malloc(row->rsize);
+      memcpy(saved_hl, row->hl, row->rsize);
+      memset(&row->hl[ri], HL_MATCH, strlen(query));
+      break;
+    }
+  }
+  free(buf);
+}
+
+void editorFind() {
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
+                             editorFindCallback);
+
+  if (query) {
+    free(query);
+  } else {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+void editorReplaceAll() {
+  char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL);
+  if (query == NULL) return;
+  char *with = query[0] ? editorPrompt("Replace with: %s (ESC to cancel)",
+                                       NULL) : NULL;
+  if (with == NULL) {
+    free(query);
+    return;
+  }
+
+  size_t qlen = strlen(query), wlen = strlen(with);
+  struct undoBatch b = { 0 };
+  b.cx = E.cx;
+  b.cy = E.cy;
+  long long count = 0;
+  char *out = NULL;
+  size_t outcap = 0;
+
+  E.hl_defer++;
+  for (int j = 0; j < E.cur->numrows; j++) {
+    erow *row = &E.cur->row[j];
+    char *p = row->chars, *end = row->chars + row->size;
+    char *match = memmem(p, end - p, query, qlen);
+    if (match == NULL) continue;
+
+    size_t len = 0;
+    while (match) {
+      size_t need = len + (match - p) + wlen + (end - match);
+      if (need + 1 > outcap) {
+        outcap = (need + 1) * 2;
+        out = realloc(out, outcap);
+      }
+      memcpy(&out[len], p, match - p);
+      len += match - p;
+      memcpy(&out[len], with, wlen);
+      len += wlen;
+      p = match + qlen;
+      count++;
+      match = memmem(p, end - p, query, qlen);
+    }
+    memcpy(&out[len], p, end - p);
+    len += end - p;
+
+    int oldsize = row->size;
+    char *chars = malloc(len + 1);
+    memcpy(chars, out, len);
+    chars[len] = '\0';
+    editorUndoSaveRow(&b, j, editorRowSwapChars(row, chars, len), oldsize);
+  }
+  E.hl_defer--;
+  free(out);
+
+  if (b.n) {
+    editorUpdateSyntaxRange(b.rows[0], b.rows[b.n - 1]);
+    editorUndoPush(&b);
+    if (E.cy < E.cur->numrows) {
+      erow *row = &E.cur->row[E.cy];
+      if (E.cx > row->size) E.cx = row->size;
+      E.cx = editorRowCharStart(row, E.cx);
+    }
+  }
+  editorSetStatusMessage("Replaced %lld occurrence%s on %d line%s",
+                         count, count == 1 ? "" : "s", b.n, b.n == 1 ? "" : "s");
+  free(query);
+  free(with);
+}
+
+/*** append buffer ***/
+
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+  int color;
+};
+
+#define ABUF_INIT {NULL, 0, 0, 39}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->b, cap);
+
+    if (new == NULL) return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+void abSetColor(struct abuf *ab, int hl) {
+  struct hlEscape *esc = &HLEscapes[hl];
+  if (ab->color == esc->color) return;
+  abAppend(ab, esc->seq, esc->len);
+  ab->color = esc->color;
+}
+
+void abFree(struct abuf *ab) {
+  free(ab->b);
+}
+
+/*** frame output ***/
+
+void editorOutputFlush() {
+  struct frameQueue *q = &E.out;
+  while (q->cur) {
+    ssize_t n = write(E.outfd, &q->cur[q->curoff], q->curlen - q->curoff);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      die("write");
+    }
+    q->curoff += n;
+    if (q->curoff == q->curlen) {
+      free(q->cur);
+      q->cur = q->next;
+      q->curlen = q->nextlen;
+      q->curoff = 0;
+      q->next = NULL;
+      q->nextlen = 0;
+    }
+  }
+}
+
+void editorQueueFrame(char *buf, int len) {
+  struct frameQueue *q = &E.out;
+  if (q->cur && q->curoff == 0) {
+    free(q->cur);
+    q->cur = NULL;
+    q->dropped++;
+  }
+  if (q->cur == NULL) {
+    q->cur = buf;
+    q->curlen = len;
+    q->curoff = 0;
+  } else {
+    if (q->next) {
+      free(q->next);
+      q->dropped++;
+    }
+    q->next = buf;
+    q->nextlen = len;
+  }
+  editorOutputFlush();
+}
+
+void editorOutputDrain() {
+  while (E.out.cur) {
+    struct pollfd pfd = { E.outfd, POLLOUT, 0 };
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) return;
+    editorOutputFlush();
+  }
+}
+
+long long editorNowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int editorPollInput(int timeout) {
+  long long deadline = editorNowMs() + timeout;
+  while (1) {
+    struct pollfd fds[4] = {
+      { STDIN_FILENO, POLLIN, 0 },
+      { E.out.cur ? E.outfd : -1, POLLOUT, 0 },
+      { E.cur->watchfd, POLLIN, 0 },
+      { E.cur->stream.fd, POLLIN, 0 }
+    };
+    int n = poll(fds, 4, timeout);
+    if (n == -1) {
+      if (errno != EINTR) die("poll");
+    } else {
+      if (fds[1].revents) editorOutputFlush();
+      if (fds[0].revents) return 1;
+      if (fds[2].revents && editorFollowEvents()) return 2;
+      if (fds[3].revents && editorStreamRead()) return 2;
+      if (n == 0) return 0;
+    }
+    if (timeout > 0) {
+      timeout = deadline - editorNowMs();
+      if (timeout < 0) timeout = 0;
+    }
+  }
+}
+
+void editorWaitForInput() {
+  while (editorPollInput(-1) != 1);
+}
+
+/*** buffers ***/
+
+struct buffer *editorBufferNew() {
+  struct buffer *b = calloc(1, sizeof(struct buffer));
+  b->vindex = (struct fenwick){ NULL, 0, 0, 1 };
+  b->bindex = (struct fenwick){ NULL, 0, 0, 1 };
+  b->wrapped = E.wrapgen;
+  b->followfd = -1;
+  b->watchfd = -1;
+  b->disk.verified = -1;
+  b->stream = (struct stream){ -1, -1, NULL };
+  b->journal.fd = -1;
+  b->journal.pending = -1;
+  b->cache.budget = E.cachebudget;
+  b->brackets.stale = 1;
+  b->brackets.mrow = -1;
+  E.bufs = realloc(E.bufs, sizeof(struct buffer *) * (E.nbufs + 1));
+  E.bufs[E.nbufs++] = b;
+  return b;
+}
+
+void editorBufferSelect(struct buffer *b) {
+  if (b == E.cur) return;
+  if (E.cur) editorJournalFlush();
+  E.cur = b;
+
+  /* One cache budget is shared by every buffer. */
+  long long used = 0;
+  for (int k = 0; k < E.nbufs; k++)
+    if (E.bufs[k] != b) used += E.bufs[k]->cache.bytes;
+  b->cache.budget = used < E.cachebudget ? E.cachebudget - used : 0;
+  if (E.wrap && b->wrapped != E.wrapgen) editorWrapRecompute();
+}
+
+struct buffer *editorBufferFind(const char *filename) {
+  for (int k = 0; k < E.nbufs; k++) {
+    char *f = E.bufs[k]->filename;
+    if (f && !strcmp(f, filename)) return E.bufs[k];
+  }
+  return NULL;
+}
+
+void editorBufferDropCache() {
+  struct renderCache *c = &E.cur->cache;
+  while (c->rows) editorCacheDrop(&E.cur->row[c->ring[c->rows - 1]]);
+}
+
+struct buffer *editorBufferModified() {
+  struct buffer *cur = E.cur, *modified = NULL;
+  for (int k = 0; k < E.nbufs && modified == NULL; k++) {
+    E.cur = E.bufs[k];
+    if (editorModified()) modified = E.cur;
+  }
+  E.cur = cur;
+  return modified;
+}
+
+void editorBufferCloseAll() {
+  for (int k = 0; k < E.nbufs; k++) {
+    E.cur = E.bufs[k];
+    editorJournalClose();
+  }
+}
+
+/*** windows ***/
+
+void editorPaneSave() {
+  struct pane *p = &E.panes[E.curpane];
+  p->cx = E.cx;
+  p->cy = E.cy;
+  p->rowoff = E.rowoff;
+  p->coloff = E.coloff;
+  p->wrapoff = E.wrapoff;
+  p->filteroff = E.cur->filter.off;
+}
+
+void editorPaneLoad(int i) {
+  struct pane *p = &E.panes[i];
+  editorBufferSelect(p->buf);
+  E.gutter = E.cur->diff.active ? 2 : 0;
+  E.curpane = i;
+  E.cx = p->cx;
+  E.cy = p->cy;
+  E.rowoff = p->rowoff;
+  E.coloff = p->coloff;
+  E.wrapoff = p->wrapoff;
+  E.cur->filter.off = p->filteroff;
+  E.screentop = p->top;
+  E.screenleft = p->left;
+  E.screenrows = p->rows - 1;
+  E.screencols = p->cols - E.gutter;
+
+  if (E.cy > E.cur->numrows) E.cy = E.cur->numrows;
+  if (E.cy < E.cur->numrows) {
+    erow *row = &E.cur->row[E.cy];
+    if (E.cx > row->size) E.cx = row->size;
+    E.cx = editorRowCharStart(row, E.cx);
+  } else {
+    E.cx = 0;
+  }
+}
+
+void editorPaneLayout(int i, int top, int left, int rows, int cols) {
+  struct pane *p = &E.panes[i];
+  p->top = top;
+  p->left = left;
+  p->rows = rows;
+  p->cols = cols;
+  if (p->child[0] == -1) {
+    int gutter = p->buf->diff.active ? 2 : 0;
+    if (cols - gutter < E.wrapcols) E.wrapcols = cols - gutter;
+  } else if (p->vertical) {
+    int first = (cols - 1) / 2;
+    editorPaneLayout(p->child[0], top, left, rows, first);
+    editorPaneLayout(p->child[1], top, left + first + 1, rows, cols - first - 1);
+  } else {
+    int first = rows / 2;
+    editorPaneLayout(p->child[0], top, left, first, cols);
+    editorPaneLayout(p->child[1], top + first, left, rows - first, cols);
+  }
+}
+
+void editorLayout() {
+  int wrapcols = E.wrapcols;
+  E.wrapcols = E.termcols;
+  editorPaneLayout(E.rootpane, 0, 0, E.termrows, E.termcols);
+  E.split = E.panes[E.rootpane].child[0] != -1;
+  if (E.wrapcols != wrapcols) E.wrapgen++;
+  if (E.wrap && E.cur->wrapped != E.wrapgen) editorWrapRecompute();
+  editorPaneLoad(E.curpane);
+}
+
+int editorPaneLeaves(int i, int *out, int n) {
+  struct pane *p = &E.panes[i];
+  if (p->child[0] == -1) {
+    out[n++] = i;
+    return n;
+  }
+  n = editorPaneLeaves(p->child[0], out, n);
+  return editorPaneLeaves(p->child[1], out, n);
+}
+
+/* A buffer no pane shows keeps its rows but gives back its render cache. */
+void editorBufferRelease(struct buffer *b) {
+  int leaves[NOTEC_PANES_MAX];
+  int n = editorPaneLeaves(E.rootpane, leaves, 0);
+  for (int k = 0; k < n; k++)
+    if (E.panes[leaves[k]].buf == b) return;
+  if (b == E.cur) {
+    b->cx = E.cx;
+    b->cy = E.cy;
+    b->rowoff = E.rowoff;
+    b->coloff = E.coloff;
+  }
+  editorBufferSelect(b);
+  editorBufferDropCache();
+}
+
+void editorPaneShow(struct buffer *b) {
+  struct pane *p = &E.panes[E.curpane];
+  struct buffer *prev = E.cur;
+  if (b == prev) return;
+  editorPaneSave();
+  p->buf = b;
+  p->cx = b->cx;
+  p->cy = b->cy;
+  p->rowoff = b->rowoff;
+  p->coloff = b->coloff;
+  p->wrapoff = 0;
+  p->filteroff = 0;
+  editorBufferRelease(prev);
+  editorLayout();
+}
+
+/* Opens a file in the current pane the way main opens the first one. Hex
+ * and pager views take the whole screen, so binary files are refused. */
+void editorPaneOpen() {
+  char *name = editorPrompt("Open: %s (ESC to cancel)", NULL);
+  if (name == NULL) return;
+  struct buffer *b = editorBufferFind(name);
+  if (b) {
+    free(name);
+    editorPaneShow(b);
+    return;
+  }
+  if (access(name, R_OK) == -1 && errno != ENOENT) {
+    editorSetStatusMessage("Can't open %.20s: %s", name, strerror(errno));
+    free(name);
+    return;
+  }
+  if (!editorFileCodec(name) && editorFileIsBinary(name)) {
+    editorSetStatusMessage("%.20s is binary; open it with notec -x", name);
+    free(name);
+    return;
+  }
+
+  b = editorBufferNew();
+  editorPaneShow(b);
+  if (access(name, F_OK) == 0) {
+    editorOpen(name);
+  } else {
+    E.cur->filename = strdup(name);
+    editorSelectSyntaxHighlight();
+  }
+  free(name);
+  editorJournalRecover();
+  if (E.followall) editorFollowStart();
+  if (E.indexall) editorIndexEnable();
+}
+
+void editorPaneNextBuffer() {
+  if (E.nbufs == 1) {
+    editorSetStatusMessage("No other buffers");
+    return;
+  }
+  int k = 0;
+  while (E.bufs[k] != E.cur) k++;
+  editorPaneShow(E.bufs[(k + 1) % E.nbufs]);
+}
+
+int editorPaneAlloc() {
+  for (int i = 0; i < NOTEC_PANES_MAX; i++) {
+    if (!E.panes[i].used) {
+      E.panes[i].used = 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void editorSplitPane(int vertical) {
+  struct pane *p = &E.panes[E.curpane];
+  if ((vertical && p->cols < 21) || (!vertical && p->rows < 4)) {
+    editorSetStatusMessage("Window too small to split");
+    return;
+  }
+  int a = editorPaneAlloc();
+  int b = a == -1 ? -1 : editorPaneAlloc();
+  if (b == -1) {
+    if (a != -1) E.panes[a].used = 0;
+    editorSetStatusMessage("Too many windows");
+    return;
+  }
+
+  editorPaneSave();
+  p = &E.panes[E.curpane];
+  E.panes[a] = *p;
+  E.panes[a].parent = E.curpane;
+  E.panes[b] = E.panes[a];
+  p->child[0] = a;
+  p->child[1] = b;
+  p->vertical = vertical;
+  E.curpane = a;
+  editorLayout();
+}
+
+void editorClosePane() {
+  int c = E.curpane;
+  int parent = E.panes[c].parent;
+  if (parent == -1) {
+    editorSetStatusMessage("Can't close the last window");
+    return;
+  }
+  struct pane *pp = &E.panes[parent];
+  int sibling = pp->child[0] == c ? pp->child[1] : pp->child[0];
+  int grandparent = pp->parent;
+  *pp = E.panes[sibling];
+  pp->parent = grandparent;
+  if (pp->child[0] != -1) {
+    E.panes[pp->child[0]].parent = parent;
+    E.panes[pp->child[1]].parent = parent;
+  }
+  E.panes[c].used = 0;
+  E.panes[sibling].used = 0;
+  editorBufferRelease(E.cur);
+
+  int next = parent;
+  while (E.panes[next].child[0] != -1) next = E.panes[next].child[0];
+  E.curpane = next;
+  editorLayout();
+}
+
+void editorNextPane() {
+  int leaves[NOTEC_PANES_MAX];
+  int n = editorPaneLeaves(E.rootpane, leaves, 0);
+  int k = 0;
+  while (leaves[k] != E.curpane) k++;
+  editorPaneSave();
+  editorPaneLoad(leaves[(k + 1) % n]);
+}
+
+void editorPaneCommand() {
+  editorSetStatusMessage("Window: s split, v vertical split, w next, c close, "
+                         "o open, n next buffer");
+  editorRefreshScreen();
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case 's': editorSplitPane(0); break;
+    case 'v': editorSplitPane(1); break;
+    case 'w':
+    case CTRL_KEY('k'): editorNextPane(); break;
+    case 'c': editorClosePane(); break;
+    case 'o': editorPaneOpen(); break;
+    case 'n': editorPaneNextBuffer(); break;
+  }
+}
+
+void editorMoveTo(struct abuf *ab, int y, int x) {
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+}
+
+void editorDrawSeparators(struct abuf *ab, int i) {
+  struct pane *p = &E.panes[i];
+  if (p->child[0] == -1) return;
+  if (p->vertical) {
+    abSetColor(ab, HL_NORMAL);
+    int x = p->left + E.panes[p->child[0]].cols;
+    for (int y = p->top; y < p->top + p->rows; y++) {
+      editorMoveTo(ab, y, x);
+      abAppend(ab, "|", 1);
+    }
+  }
+  editorDrawSeparators(ab, p->child[0]);
+  editorDrawSeparators(ab, p->child[1]);
+}
+
+/*** output ***/
+
+void editorScroll() {
+  E.rx = 0;
+  if (E.cy < E.cur->numrows) {
+    E.rx = editorRowCxToRx(&E.cur->row[E.cy], E.cx);
+  }
+
+  if (E.cur->filter.active) {
+    editorFilterScroll();
+    return;
+  }
+
+  editorFoldReveal(E.cy);
+  if (E.wrap) {
+    editorWrapIndexUpdate();
+    E.coloff = 0;
+    if (E.rowoff > E.cur->numrows) E.rowoff = E.cur->numrows;
+    long long cursor = editorVisualLine(E.cy, E.rx, NULL);
+    long long top = fenwickPrefix(&E.cur->vindex, E.rowoff) + E.wrapoff;
+    if (cursor < top) top = cursor;
+    if (cursor >= top + E.screenrows) top = cursor - E.screenrows + 1;
+    editorVisualToRow(top, &E.rowoff, &E.wrapoff);
+    return;
+  }
+
+  int cursor = editorRowToVisible(E.cy);
+  int top = editorRowToVisible(E.rowoff);
+  if (cursor < top) {
+    top = cursor;
+  }
+  if (cursor >= top + E.screenrows) {
+    top = cursor - E.screenrows + 1;
+  }
+  E.rowoff = editorVisibleToRow(top);
+  if (E.rx < E.coloff) {
+    E.coloff = E.rx;
+  }
+  if (E.rx >= E.coloff + E.screencols) {
+    E.coloff = E.rx - E.screencols + 1;
+  }
+}
+
+void editorDrawRun(struct abuf *ab, erow *row, int from, int to, int mark) {
+  abSetColor(ab, row->hl[from]);
+  if (mark) abAppend(ab, "\x1b[7m", 4);
+  abAppend(ab, &row->render[from], to - from);
+  if (mark) {
+    abAppend(ab, "\x1b[m", 3);
+    ab->color = 39;
+  }
+}
+
+int editorDrawRowSegment(struct abuf *ab, erow *row, int col, int ncols,
+                         int m0, int m1) {
+  editorRowEnsure(row);
+  char *c = row->render;
+  unsigned char *hl = row->hl;
+  int limit = col + ncols;
+  int cp;
+
+  int cx = editorRowRxToCx(row, col);
+  int i = editorRowCxToRi(row, cx);
+  int x = editorRowCxToRx(row, cx);
+  while (x < col && i < row->rsize) {
+    int n = utf8Decode(&c[i], row->rsize - i, &cp);
+    int w = utf8Width(cp);
+    for (int pad = col; pad < x + w && pad < limit; pad++) abAppend(ab, " ", 1);
+    x += w;
+    i += n;
+  }
+
+  int run = i;
+  while (i < row->rsize) {
+    int n = 1;
+    int w = 1;
+    if ((unsigned char)c[i] < 0x80) {
+      cp = (unsigned char)c[i];
+    } else {
+      n = utf8Decode(&c[i], row->rsize - i, &cp);
+      w = utf8Width(cp);
+    }
+    if (x + w > limit) break;
+
+    if (utf8IsSymbol(cp) || hl[i] != hl[run] || i == m0 || i == m1) {
+      if (i > run) editorDrawRun(ab, row, run, i, run >= m0 && run < m1);
+      run = i;
+    }
+    if (utf8IsSymbol(cp)) {
+      char sym[] = "\x1b[7m?\x1b[m";
+      if (cp >= 0 && cp <= 26) sym[4] = '@' + cp;
+      abAppend(ab, sym, sizeof(sym) - 1);
+      ab->color = 39;
+      run = i + n;
+    }
+    x += w;
+    i += n;
+  }
+  if (i > run) editorDrawRun(ab, row, run, i, run >= m0 && run < m1);
+  if (m0 == row->rsize && i == row->rsize && x < limit) {
+    abAppend(ab, "\x1b[7m \x1b[m", 8);
+    ab->color = 39;
+    x++;
+  }
+  return x > col ? x - col : 0;
+}
+
+void editorDrawFoldMarker(struct abuf *ab, int filerow, int room) {
+  int i = editorFoldFind(filerow);
+  if (i == E.cur->folds.n || E.cur->folds.folds[i].start != filerow) return;
+  char marker[32];
+  int len = snprintf(marker, sizeof(marker), " [+%d]",
+                     E.cur->folds.folds[i].end - E.cur->folds.folds[i].start);
+  if (len > room) return;
+  abSetColor(ab, HL_COMMENT);
+  abAppend(ab, marker, len);
+}
+
+void editorCursorScreenPos(int *y, int *x) {
+  if (E.cur->filter.active) {
+    *y = editorFilterFind(E.cy) - E.cur->filter.off;
+    *x = E.rx - E.coloff;
+  } else if (E.wrap) {
+    int start;
+    long long v = editorVisualLine(E.cy, E.rx, &start);
+    *y = v - (fenwickPrefix(&E.cur->vindex, E.rowoff) + E.wrapoff);
+    *x = E.rx - start;
+  } else {
+    *y = editorRowToVisible(E.cy) - editorRowToVisible(E.rowoff);
+    *x = E.rx - E.coloff;
+  }
+}
+
+void editorDrawGutter(struct abuf *ab, int filerow) {
+  int hl = filerow >= 0 ? editorDiffMark(filerow) : HL_NORMAL;
+  abSetColor(ab, hl);
+  switch (hl) {
+    case HL_DIFF_ADD: abAppend(ab, "+ ", 2); break;
+    case HL_DIFF_CHANGE: abAppend(ab, "~ ", 2); break;
+    case HL_DIFF_DELETE: abAppend(ab, "- ", 2); break;
+    default: abAppend(ab, "  ", 2); break;
+  }
+}
+
+void editorDrawRows(struct abuf *ab) {
+  int filerow = E.rowoff;
+  int seg = E.wrapoff;
+  int y;
+  for (y = 0; y < E.screenrows; y++) {
+    if (E.split) editorMoveTo(ab, E.screentop + y, E.screenleft);
+    if (E.gutter) {
+      int at = filerow < E.cur->numrows ? filerow : -1;
+      if (at != -1 && E.cur->filter.active)
+        at = editorFilterRow(E.cur->filter.off + y);
+      editorDrawGutter(ab, at);
+    }
+    if (filerow >= E.cur->numrows) {
+      abSetColor(ab, HL_NORMAL);
+      if (E.cur->numrows == 0 && y == E.screenrows / 3) {
+        char welcome[80];
+        int welcomelen = snprintf(welcome, sizeof(welcome),
+          "notec editor -- version %s", NOTEC_VERSION);
+        if (welcomelen > E.screencols) welcomelen = E.screencols;
+        int padding = (E.screencols - welcomelen) / 2;
+        if (padding) {
+          abAppend(ab, "~", 1);
+          padding--;
+        }
+        while (padding--) abAppend(ab, " ", 1);
+        abAppend(ab, welcome, welcomelen);
+      } else {
+        abAppend(ab, "~", 1);
+      }
+    } else if (E.cur->filter.active) {
+      int at = editorFilterRow(E.cur->filter.off + y);
+      if (at != -1) {
+        int m0 = -1, m1 = -1;
+        editorRowMark(at, &m0, &m1);
+        editorDrawRowSegment(ab, &E.cur->row[at], E.coloff, E.screencols,
+                             m0, m1);
+      } else {
+        abSetColor(ab, HL_NORMAL);
+        abAppend(ab, "~", 1);
+      }
+    } else if (E.wrap) {
+      erow *row = &E.cur->row[filerow];
+      int m0 = -1, m1 = -1;
+      editorRowMark(filerow, &m0, &m1);
+      int start = editorRowWrapStart(row, seg);
+      int end = (row->rwidth - start >= E.wrapcols)
+                  ? editorRowWrapBreak(row, start) : start + E.wrapcols;
+      int used = editorDrawRowSegment(ab, row, start, end - start, m0, m1);
+      if (++seg >= row->vlines) {
+        editorDrawFoldMarker(ab, filerow, E.screencols - used);
+        filerow = editorFoldNextRow(filerow);
+        seg = 0;
+      }
+    } else {
+      int m0 = -1, m1 = -1;
+      editorRowMark(filerow, &m0, &m1);
+      int used = editorDrawRowSegment(ab, &E.cur->row[filerow], E.coloff,
+                                      E.screencols, m0, m1);
+      editorDrawFoldMarker(ab, filerow, E.screencols - used);
+      filerow = editorFoldNextRow(filerow);
+    }
+
+    abAppend(ab, "\x1b[K", 3);
+    abAppend(ab, "\r\n", 2);
+  }
+}
+
+void editorDrawStatusBar(struct abuf *ab) {
+  if (E.split) editorMoveTo(ab, E.screentop + E.screenrows, E.screenleft);
+  abSetColor(ab, HL_NORMAL);
+  abAppend(ab, "\x1b[7m", 4);
+  char status[80], rstatus[80];
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s",
+    E.cur->filename ? E.cur->filename : "[No Name]", E.cur->numrows,
+    editorModified() ? "(modified) " : "", E.cur->follow ? "[follow]" : "");
+  if (E.cur->filter.active) {
+    len += snprintf(&status[len], sizeof(status) - len, "[filter: %.16s, %d]",
+                    E.cur->filter.pattern, E.cur->filter.n);
+    if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+  }
+  if (E.cur->diff.active) {
+    len += snprintf(&status[len], sizeof(status) - len, "[diff: %d]",
+                    E.cur->diff.n);
+    if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+  }
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+    E.cur->syntax ? E.cur->syntax->filetype : "no ft", E.cy + 1,
+    E.cur->numrows);
+  int cols = E.screencols + E.gutter;
+  if (len > cols) len = cols;
+  abAppend(ab, status, len);
+  while (len < cols) {
+    if (cols - len == rlen) {
+      abAppend(ab, rstatus, rlen);
+      break;
+    } else {
+      abAppend(ab, " ", 1);
+      len++;
+    }
+  }
+  abAppend(ab, "\x1b[m", 3);
+  abAppend(ab, "\r\n", 2);
+}
+
+void editorDrawMessageBar(struct abuf *ab) {
+  if (E.split) editorMoveTo(ab, E.termrows, 0);
+  abAppend(ab, "\x1b[K", 3);
+  int msglen = strlen(E.statusmsg);
+  if (msglen > E.termcols) msglen = E.termcols;
+  if (msglen && time(NULL) - E.statusmsg_time < 5)
+    abAppend(ab, E.statusmsg, msglen);
+}
+
+void editorRefreshScreen() {
+  if (E.cur->pager.active) {
+    editorPagerRefresh();
+    return;
+  }
+  if (E.cur->hex.active) {
+    editorHexRefresh();
+    return;
+  }
+
+  struct abuf ab = ABUF_INIT;
+
+  if (E.sync_output) abAppend(&ab, "\x1b[?2026h", 8);
+  abAppend(&ab, "\x1b[?25l", 6);
+  abAppend(&ab, "\x1b[H", 3);
+
+  int leaves[NOTEC_PANES_MAX];
+  int n = editorPaneLeaves(E.rootpane, leaves, 0);
+  int current = E.curpane;
+  editorPaneSave();
+  for (int k = 0; k < n; k++) {
+    editorPaneLoad(leaves[k]);
+    if (E.cur->diff.active && E.cur->diff.stale) editorDiffUpdate();
+    editorScroll();
+    editorBracketUpdateMatch();
+    editorDrawRows(&ab);
+    editorDrawStatusBar(&ab);
+    editorPaneSave();
+  }
+  editorPaneLoad(current);
+  editorDrawSeparators(&ab, E.rootpane);
+  editorDrawMessageBar(&ab);
+
+  int cury, curx;
+  editorCursorScreenPos(&cury, &curx);
+  editorMoveTo(&ab, E.screentop + cury, E.screenleft + E.gutter + curx);
+
+  abAppend(&ab, "\x1b[?25h", 6);
+  if (E.sync_output) abAppend(&ab, "\x1b[?2026l", 8);
+
+  editorQueueFrame(ab.b, ab.len);
+}
+
+void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+}
+
+/*** input ***/
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
+
+  size_t buflen = 0;
+  buf[0] = '\0';
+
+  while (1) {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      while (buflen != 0 && ((unsigned char)buf[buflen - 1] & 0xC0) == 0x80)
+        buflen--;
+      if (buflen != 0) buflen--;
+      buf[buflen] = '\0';
+    } else if (c == '\x1b') {
+      editorSetStatusMessage("");
+      if (callback) callback(buf, c);
+      free(buf);
+      return NULL;
+    } else if (c == '\r') {
+      if (buflen != 0) {
+        editorSetStatusMessage("");
+        if (callback) callback(buf, c);
+        return buf;
+      }
+    } else if (c < 256 && !iscntrl(c)) {
+      if (buflen == bufsize - 1) {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+
+    if (callback) callback(buf, c);
+  }
+}
+
+int editorConfirm(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+  editorRefreshScreen();
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  return c == 'y' || c == 'Y';
+}
+
+void editorMoveCursor(int key) {
+  erow *row = (E.cy >= E.cur->numrows) ? NULL : &E.cur->row[E.cy];
+
+  switch (key) {
+    case ARROW_LEFT:
+      if (E.cx != 0) {
+        E.cx = editorRowPrevChar(row, E.cx);
+      } else if (editorViewStep(E.cy, -1) != E.cy) {
+        E.cy = editorViewStep(E.cy, -1);
+        E.cx = E.cur->row[E.cy].size;
+      }
+      break;
+    case ARROW_RIGHT:
+      if (row && E.cx < row->size) {
+        E.cx = editorRowNextChar(row, E.cx);
+      } else if (row && editorViewStep(E.cy, 1) != E.cy) {
+        E.cy = editorViewStep(E.cy, 1);
+        E.cx = 0;
+      }
+      break;
+    case ARROW_UP:
+      if (E.wrap && !E.cur->filter.active) {
+        editorMoveCursorVisual(-1);
+      } else {
+        E.cy = editorViewStep(E.cy, -1);
+      }
+      break;
+    case ARROW_DOWN:
+      if (E.wrap && !E.cur->filter.active) {
+        editorMoveCursorVisual(1);
+      } else {
+        E.cy = editorViewStep(E.cy, 1);
+      }
+      break;
+  }
+
+  row = (E.cy >= E.cur->numrows) ? NULL : &E.cur->row[E.cy];
+  int rowlen = row ? row->size : 0;
+  if (E.cx > rowlen) {
+    E.cx = rowlen;
+  }
+  if (row) E.cx = editorRowCharStart(row, E.cx);
+}
+
+void editorProcessKeypress() {
+  static int quit_times = NOTEC_QUIT_TIMES;
+
+  if (E.cur->pager.active) {
+    editorPagerProcessKeypress();
+    return;
+  }
+  if (E.cur->hex.active) {
+    editorHexProcessKeypress();
+    return;
+  }
+
+  int c = editorReadKey();
+
+  if (E.cur->sel.active) {
+    switch (c) {
+      case CTRL_KEY('c'):
+      case CTRL_KEY('x'):
+        editorCopySelection(c == CTRL_KEY('x'));
+        return;
+      case ARROW_UP:
+      case ARROW_DOWN:
+      case ARROW_LEFT:
+      case ARROW_RIGHT:
+      case PAGE_UP:
+      case PAGE_DOWN:
+      case HOME_KEY:
+      case END_KEY:
+      case CTRL_KEY('@'):
+      case CTRL_KEY('f'):
+      case CTRL_KEY('g'):
+      case CTRL_KEY('l'):
+      case CTRL_KEY('w'):
+        break;
+      default:
+        E.cur->sel.active = 0;
+        if (c == '\x1b') return;
+    }
+  }
+
+  if (E.cur->cursors.n || E.cur->block.active) {
+    switch (c) {
+      case BACKSPACE:
+      case CTRL_KEY('h'):
+      case DEL_KEY:
+        editorCursorsEdit(c);
+        return;
+      case ARROW_LEFT:
+      case ARROW_RIGHT:
+      case HOME_KEY:
+      case END_KEY:
+        if (!E.cur->block.active) editorCursorsMove(c);
+        break;
+      case ARROW_UP:
+      case ARROW_DOWN:
+      case PAGE_UP:
+      case PAGE_DOWN:
+      case CTRL_KEY('b'):
+      case CTRL_KEY('g'):
+      case CTRL_KEY('n'):
+      case CTRL_KEY('l'):
+      case CTRL_KEY('s'):
+      case CTRL_KEY('w'):
+        break;
+      default:
+        if (c == '\t' || (c >= 32 && c < 256)) {
+          editorCursorsEdit(c);
+          return;
+        }
+        editorCursorsClear();
+        if (c == '\x1b') return;
+    }
+  }
+
+  switch (c) {
+    case '\r':
+      editorInsertNewline();
+      break;
+
+    case CTRL_KEY('q'):
+      if (editorBufferModified() && quit_times > 0) {
+        editorSetStatusMessage("WARNING!!! %s unsaved changes. "
+          "Press Ctrl-Q %d more times to quit.",
+          editorModified() ? "File has" : "Another file has", quit_times);
+        quit_times--;
+        return;
+      }
+      editorBufferCloseAll();
+      editorOutputDrain();
+      write(STDOUT_FILENO, "\x1b[2J", 4);
+      write(STDOUT_FILENO, "\x1b[H", 3);
+      exit(0);
+      break;
+
+    case CTRL_KEY('s'):
+      editorSave();
+      break;
+
+    case HOME_KEY:
+      E.cx = 0;
+      break;
+
+    case END_KEY:
+      if (E.cy < E.cur->numrows)
+        E.cx = E.cur->row[E.cy].size;
+      break;
+
+    case CTRL_KEY('f'):
+      editorFind();
+      break;
+
+    case CTRL_KEY('w'):
+      editorToggleWrap();
+      break;
+
+    case CTRL_KEY('g'):
+      editorGoTo();
+      break;
+
+    case CTRL_KEY('t'):
+      editorToggleFollow();
+      break;
+
+    case CTRL_KEY('r'):
+      editorReplaceAll();
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('n'):
+      editorCursorAdd();
+      break;
+
+    case CTRL_KEY('b'):
+      editorToggleBlock();
+      break;
+
+    case CTRL_KEY('@'):
+      editorToggleMark();
+      break;
+
+    case CTRL_KEY('c'):
+    case CTRL_KEY('x'):
+      editorSetStatusMessage("Set a mark with Ctrl-Space first");
+      break;
+
+    case CTRL_KEY('v'):
+      editorPaste();
+      break;
+
+    case CTRL_KEY('e'):
+      editorFilter();
+      break;
+
+    case CTRL_KEY('y'):
+      editorToggleFold();
+      break;
+
+    case CTRL_KEY('p'):
+      editorBracketJump();
+      break;
+
+    case CTRL_KEY('k'):
+      editorPaneCommand();
+      break;
+
+    case CTRL_KEY('d'):
+      editorToggleDiff();
+      break;
+
+    case CTRL_KEY('u'):
+      editorCacheStats();
+      break;
+
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+    case DEL_KEY:
+      if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
+      editorDelChar();
+      break;
+
+    case PAGE_UP:
+    case PAGE_DOWN:
+      if (E.wrap && !E.cur->filter.active) {
+        editorMoveCursorVisual(c == PAGE_UP ? -E.screenrows : E.screenrows);
+        break;
+      }
+      {
+        if (E.cur->filter.active || E.cur->folds.n) {
+          E.cy = editorViewStep(E.cy, c == PAGE_UP ? -E.screenrows
+                                                   : E.screenrows);
+        } else if (c == PAGE_UP) {
+          E.cy = E.rowoff > E.screenrows ? E.rowoff - E.screenrows : 0;
+        } else {
+          E.cy = E.rowoff + 2 * E.screenrows - 1;
+          if (E.cy > E.cur->numrows) E.cy = E.cur->numrows;
+        }
+
+        int rowlen = E.cy < E.cur->numrows ? E.cur->row[E.cy].size : 0;
+        if (E.cx > rowlen) E.cx = rowlen;
+        if (rowlen) E.cx = editorRowCharStart(&E.cur->row[E.cy], E.cx);
+      }
+      break;
+
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+      editorMoveCursor(c);
+      break;
+
+    case CTRL_KEY('l'):
+    case '\x1b':
+      break;
+
+    default:
+      editorInsertChar(c);
+      break;
+  }
+
+  quit_times = NOTEC_QUIT_TIMES;
+}
+
+/*** pager ***/
+
+void editorPagerAddMark(long long offset) {
+  pthread_mutex_lock(&E.cur->pager.lock);
+  if (E.cur->pager.nmarks == E.cur->pager.markcap) {
+    E.cur->pager.markcap = E.cur->pager.markcap ? E.cur->pager.markcap * 2
+                                                : 1024;
+    E.cur->pager.marks = realloc(E.cur->pager.marks,
+                            sizeof(long long) * E.cur->pager.markcap);
+  }
+  E.cur->pager.marks[E.cur->pager.nmarks++] = offset;
+  pthread_mutex_unlock(&E.cur->pager.lock);
+}
+
+void *editorPagerIndex(void *arg) {
+  struct pager *p = arg;
+  char *buf = malloc(NOTEC_PAGER_CHUNK);
+  long long off = 0, line = 0;
+  ssize_t n;
+
+  posix_fadvise(p->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  while ((n = pread(p->fd, buf, NOTEC_PAGER_CHUNK, off)) > 0) {
+    char *q = buf, *end = buf + n;
+    while ((q = memchr(q, '\n', end - q)) != NULL) {
+      q++;
+      if (++line % NOTEC_PAGER_STRIDE == 0 && off + (q - buf) < (long long)p->size)
+        editorPagerAddMark(off + (q - buf));
+    }
+    off += n;
+    pthread_mutex_lock(&p->lock);
+    p->indexed = off;
+    pthread_mutex_unlock(&p->lock);
+  }
+  free(buf);
+
+  pthread_mutex_lock(&p->lock);
+  p->lines = line + (p->size && p->map[p->size - 1] != '\n');
+  p->done = 1;
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+void editorPagerOpen(char *filename) {
+  free(E.cur->filename);
+  E.cur->filename = strdup(filename);
+
+  struct pager *p = &E.cur->pager;
+  p->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (p->fd == -1) die("open");
+  struct stat st;
+  if (fstat(p->fd, &st) == -1) die("fstat");
+  p->size = st.st_size;
+  if (p->size > 0) {
+    p->map = mmap(NULL, p->size, PROT_READ, MAP_PRIVATE, p->fd, 0);
+    if (p->map == MAP_FAILED) die("mmap");
+  }
+  p->active = 1;
+  pthread_mutex_init(&p->lock, NULL);
+  editorPagerAddMark(0);
+  if (pthread_create(&p->thread, NULL, editorPagerIndex, p) != 0)
+    die("pthread_create");
+}
+
+size_t editorPagerLineStart(size_t off) {
+  if (off == 0) return 0;
+  const char *nl = memrchr(E.cur->pager.map, '\n', off);
+  return nl ? (size_t)(nl - E.cur->pager.map) + 1 : 0;
+}
+
+size_t editorPagerNextLine(size_t off) {
+  if (off >= E.cur->pager.size) return off;
+  const char *nl = memchr(&E.cur->pager.map[off], '\n',
+                          E.cur->pager.size - off);
+  if (nl == NULL || (size_t)(nl - E.cur->pager.map) + 1 >= E.cur->pager.size)
+    return off;
+  return nl - E.cur->pager.map + 1;
+}
+
+size_t editorPagerPrevLine(size_t off) {
+  return off ? editorPagerLineStart(off - 1) : 0;
+}
+
+long long editorPagerLineAt(size_t off) {
+  struct pager *p = &E.cur->pager;
+  pthread_mutex_lock(&p->lock);
+  if (!p->done && (long long)off > p->indexed) {
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  int lo = 0, hi = p->nmarks - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (p->marks[mid] <= (long long)off) lo = mid;
+    else hi = mid - 1;
+  }
+  long long line = (long long)lo * NOTEC_PAGER_STRIDE;
+  size_t start = p->marks[lo];
+  pthread_mutex_unlock(&p->lock);
+
+  const char *nl;
+  while (start < off &&
+         (nl = memchr(&p->map[start], '\n', off - start)) != NULL) {
+    start = nl - p->map + 1;
+    line++;
+  }
+  return line;
+}
+
+long long editorPagerLineOffset(long long line) {
+  struct pager *p = &E.cur->pager;
+  pthread_mutex_lock(&p->lock);
+  long long k = line / NOTEC_PAGER_STRIDE;
+  if (k >= p->nmarks && !p->done) {
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  if (k >= p->nmarks) k = p->nmarks - 1;
+  size_t off = p->marks[k];
+  pthread_mutex_unlock(&p->lock);
+
+  for (line -= k * NOTEC_PAGER_STRIDE; line > 0; line--) {
+    size_t next = editorPagerNextLine(off);
+    if (next == off) break;
+    off = next;
+  }
+  return off;
+}
+
+void editorPagerScroll(int delta) {
+  struct pager *p = &E.cur->pager;
+  for (; delta > 0; delta--) {
+    size_t next = editorPagerNextLine(p->top);
+    if (next == p->top) break;
+    p->top = next;
+    if (p->topline >= 0) p->topline++;
+  }
+  for (; delta < 0 && p->top > 0; delta++) {
+    p->top = editorPagerPrevLine(p->top);
+    if (p->topline > 0) p->topline--;
+  }
+}
+
+void editorPagerJump(size_t off) {
+  E.cur->pager.top = editorPagerLineStart(off < E.cur->pager.size
+                                            ? off : E.cur->pager.size);
+  E.cur->pager.topline = -1;
+}
+
+void editorPagerEnd() {
+  struct pager *p = &E.cur->pager;
+  p->top = p->size ? editorPagerLineStart(p->size - 1) : 0;
+  p->topline = -1;
+  editorPagerScroll(-(E.screenrows - 1));
+}
+
+void editorPagerDrawLine(struct abuf *ab, const char *s, size_t len) {
+  int coloff = E.cur->pager.coloff;
+  int limit = coloff + E.screencols;
+  int x = 0;
+  size_t i = 0;
+  if (len > 0 && s[len - 1] == '\r') len--;
+  while (i < len && x < limit) {
+    int cp = (unsigned char)s[i];
+    int n = 1, w = 1;
+    if (cp == '\t') {
+      int next = (x / NOTEC_TAB_STOP + 1) * NOTEC_TAB_STOP;
+      for (; x < next && x < limit; x++)
+        if (x >= coloff) abAppend(ab, " ", 1);
+      i++;
+      continue;
+    }
+    if (cp >= 0x80) {
+      n = utf8Decode(&s[i], len - i < 4 ? (int)(len - i) : 4, &cp);
+      w = utf8Width(cp);
+    }
+    if (x + w > limit) break;
+    if (x < coloff) {
+      for (int pad = coloff; pad < x + w; pad++) abAppend(ab, " ", 1);
+    } else if (utf8IsSymbol(cp)) {
+      char sym[] = "\x1b[7m?\x1b[m";
+      if (cp >= 0 && cp <= 26) sym[4] = '@' + cp;
+      abAppend(ab, sym, sizeof(sym) - 1);
+    } else {
+      abAppend(ab, &s[i], n);
+    }
+    x += w;
+    i += n;
+  }
+}
+
+void editorPagerDrawStatusBar(struct abuf *ab, size_t bottom) {
+  struct pager *p = &E.cur->pager;
+  abAppend(ab, "\x1b[7m", 4);
+  char status[80], rstatus[80], where[40];
+  if (p->topline < 0) p->topline = editorPagerLineAt(p->top);
+
+  pthread_mutex_lock(&p->lock);
+  int done = p->done;
+  long long lines = p->lines;
+  long long indexed = p->indexed;
+  pthread_mutex_unlock(&p->lock);
+
+  if (p->topline < 0)
+    snprintf(where, sizeof(where), "line ?");
+  else if (done)
+    snprintf(where, sizeof(where), "line %lld/%lld", p->topline + 1, lines);
+  else
+    snprintf(where, sizeof(where), "line %lld", p->topline + 1);
+
+  int len = snprintf(status, sizeof(status), "%.20s - view", E.cur->filename);
+  int rlen;
+  if (done || p->size == 0)
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d%%", where,
+                    p->size ? (int)(bottom * 100 / p->size) : 100);
+  else
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d%% (indexing %d%%)",
+                    where, (int)(bottom * 100 / p->size),
+                    (int)(indexed * 100 / p->size));
+  if (len > E.screencols) len = E.screencols;
+  abAppend(ab, status, len);
+  while (len < E.screencols) {
+    if (E.screencols - len == rlen) {
+      abAppend(ab, rstatus, rlen);
+      break;
+    } else {
+      abAppend(ab, " ", 1);
+      len++;
+    }
+  }
+  abAppend(ab, "\x1b[m", 3);
+  abAppend(ab, "\r\n", 2);
+}
+
+void editorPagerRefresh() {
+  struct pager *p = &E.cur->pager;
+  struct abuf ab = ABUF_INIT;
+
+  if (E.sync_output) abAppend(&ab, "\x1b[?2026h", 8);
+  abAppend(&ab, "\x1b[?25l", 6);
+  abAppend(&ab, "\x1b[H", 3);
+
+  size_t off = p->top;
+  int more = p->size > 0;
+  for (int y = 0; y < E.screenrows; y++) {
+    if (more) {
+      const char *nl = memchr(&p->map[off], '\n', p->size - off);
+      size_t end = nl ? (size_t)(nl - p->map) : p->size;
+      editorPagerDrawLine(&ab, &p->map[off], end - off);
+      size_t next = editorPagerNextLine(off);
+      more = next != off;
+      off = more ? next : p->size;
+    } else {
+      abAppend(&ab, "~", 1);
+    }
+    abAppend(&ab, "\x1b[K\r\n", 5);
+  }
+
+  editorPagerDrawStatusBar(&ab, off);
+  editorDrawMessageBar(&ab);
+
+  char buf[32];
+  int msglen = strlen(E.statusmsg);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.screenrows + 2,
+           (msglen < E.screencols ? msglen : E.screencols - 1) + 1);
+  abAppend(&ab, buf, strlen(buf));
+  abAppend(&ab, "\x1b[?25h", 6);
+  if (E.sync_output) abAppend(&ab, "\x1b[?2026l", 8);
+
+  editorQueueFrame(ab.b, ab.len);
+}
+
+void editorPagerGoTo() {
+  char *query = editorPrompt("Go to line, N%% or @offset: %s", NULL);
+  if (query == NULL) return;
+
+  char *end;
+  if (query[0] == '@') {
+    long long offset = strtoll(&query[1], &end, 0);
+    if (end == &query[1] || *end != '\0' || offset < 0)
+      editorSetStatusMessage("Bad offset: %s", query);
+    else
+      editorPagerJump(offset);
+  } else {
+    long long n = strtoll(query, &end, 10);
+    if (end == query || n < 0) {
+      editorSetStatusMessage("Bad position: %s", query);
+    } else if (*end == '%' && end[1] == '\0') {
+      if (n > 100) n = 100;
+      editorPagerJump(E.cur->pager.size / 100 * n +
+                      E.cur->pager.size % 100 * n / 100);
+    } else if (*end == '\0') {
+      long long off = editorPagerLineOffset(n > 0 ? n - 1 : 0);
+      if (off < 0) {
+        editorSetStatusMessage("Line %lld is not indexed yet", n);
+      } else {
+        E.cur->pager.top = off;
+        E.cur->pager.topline = -1;
+      }
+    } else {
+      editorSetStatusMessage("Bad position: %s", query);
+    }
+  }
+  free(query);
+}
+
+void editorPagerFind(int prompt) {
+  struct pager *p = &E.cur->pager;
+  if (prompt || p->query == NULL) {
+    char *query = editorPrompt("Search: %s (ESC to cancel)", NULL);
+    if (query == NULL) return;
+    free(p->query);
+    p->query = query;
+  }
+
+  size_t from = editorPagerNextLine(p->top);
+  const char *match = NULL;
+  if (from != p->top)
+    match = memmem(&p->map[from], p->size - from, p->query,
+                   strlen(p->query));
+  /* Drop the pages the scan faulted in so the footprint stays flat. */
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t lo = (from + page - 1) / page * page;
+  size_t hi = (match ? (size_t)(match - p->map) : p->size) / page * page;
+  if (hi > lo + page)
+    madvise((void *)&p->map[lo], hi - lo - page, MADV_DONTNEED);
+
+  if (match) editorPagerJump(match - p->map);
+  else editorSetStatusMessage("Not found: %s", p->query);
+}
+
+void editorPagerProcessKeypress() {
+  int c = editorReadKey();
+
+  switch (c) {
+    case 'q':
+    case CTRL_KEY('q'):
+      editorOutputDrain();
+      write(STDOUT_FILENO, "\x1b[2J", 4);
+      write(STDOUT_FILENO, "\x1b[H", 3);
+      exit(0);
+      break;
+
+    case ARROW_DOWN:
+    case 'j':
+    case '\r':
+      editorPagerScroll(1);
+      break;
+
+    case ARROW_UP:
+    case 'k':
+      editorPagerScroll(-1);
+      break;
+
+    case PAGE_DOWN:
+    case ' ':
+      editorPagerScroll(E.screenrows);
+      break;
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
-    return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
-  }
+    case PAGE_UP:
+    case 'b':
+      editorPagerScroll(-E.screenrows);
+      break;
 
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
+    case HOME_KEY:
+    case 'g':
+      E.cur->pager.top = 0;
+      E.cur->pager.topline = 0;
+      break;
 
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
+    case END_KEY:
+    case 'G':
+      editorPagerEnd();
+      break;
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+    case ARROW_LEFT:
+      E.cur->pager.coloff -= E.screencols / 2;
+      if (E.cur->pager.coloff < 0) E.cur->pager.coloff = 0;
       break;
-    }
-  }
-}
 
-void editorFind() {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+    case ARROW_RIGHT:
+      E.cur->pager.coloff += E.screencols / 2;
+      break;
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                             editorFindCallback);
+    case CTRL_KEY('g'):
+      editorPagerGoTo();
+      break;
 
-  if (query) {
-    free(query);
-  } else {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    case CTRL_KEY('f'):
+    case '/':
+      editorPagerFind(1);
+      break;
+
+    case 'n':
+      editorPagerFind(0);
+      break;
   }
 }
 
-/*** append buffer ***/
-
-struct abuf {
-  char *b;
-  int len;
-};
-
-#define ABUF_INIT {NULL, 0}
+/*** hex view ***/
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+#define NOTEC_HEX_WIDTH 16
 
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+int editorFileIsBinary(const char *filename) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return 0;
+  char buf[8192];
+  ssize_t n = read(fd, buf, sizeof(buf));
+  close(fd);
+  return n > 0 && memchr(buf, '\0', n) != NULL;
 }
 
-void abFree(struct abuf *ab) {
-  free(ab->b);
+void editorHexOpen(char *filename) {
+  free(E.cur->filename);
+  E.cur->filename = strdup(filename);
+
+  struct hexView *h = &E.cur->hex;
+  h->fd = open(filename, O_RDWR | O_CLOEXEC);
+  h->writable = h->fd != -1;
+  if (h->fd == -1) h->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (h->fd == -1) die("open");
+  struct stat st;
+  if (fstat(h->fd, &st) == -1) die("fstat");
+  h->size = st.st_size;
+  /* A private mapping lets bytes be patched in memory without touching the
+   * file; only the pages marked dirty are written back on save. */
+  if (h->size > 0) {
+    h->map = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, h->fd,
+                  0);
+    if (h->map == MAP_FAILED) die("mmap");
+  }
+  h->page = sysconf(_SC_PAGESIZE);
+  h->npages = (h->size + h->page - 1) / h->page;
+  h->dirty = calloc(h->npages / 8 + 1, 1);
+  h->offwidth = 8;
+  while (h->offwidth < 16 && (h->size >> (4 * h->offwidth)) > 0)
+    h->offwidth++;
+  h->active = 1;
 }
 
-/*** output ***/
+int editorHexColumn(int i) {
+  return E.cur->hex.offwidth + 2 + i * 3 + (i >= NOTEC_HEX_WIDTH / 2);
+}
 
-void editorScroll() {
-  E.rx = 0;
-  if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
-  }
+int editorHexAsciiColumn(int i) {
+  return editorHexColumn(NOTEC_HEX_WIDTH) + 1 + i;
+}
 
-  if (E.cy < E.rowoff) {
-    E.rowoff = E.cy;
-  }
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
-  }
-  if (E.rx < E.coloff) {
-    E.coloff = E.rx;
-  }
-  if (E.rx >= E.coloff + E.screencols) {
-    E.coloff = E.rx - E.screencols + 1;
-  }
+void editorHexScroll() {
+  struct hexView *h = &E.cur->hex;
+  size_t row = h->cursor / NOTEC_HEX_WIDTH * NOTEC_HEX_WIDTH;
+  size_t span = (size_t)E.screenrows * NOTEC_HEX_WIDTH;
+  if (row < h->top) h->top = row;
+  if (row >= h->top + span) h->top = row - span + NOTEC_HEX_WIDTH;
 }
 
-void editorDrawRows(struct abuf *ab) {
-  int y;
-  for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
-    if (filerow >= E.numrows) {
-      if (E.numrows == 0 && y == E.screenrows / 3) {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome),
-          "notec editor -- version %s", NOTEC_VERSION);
-        if (welcomelen > E.screencols) welcomelen = E.screencols;
-        int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
-      } else {
-        abAppend(ab, "~", 1);
-      }
+void editorHexDrawRow(struct abuf *ab, size_t off) {
+  struct hexView *h = &E.cur->hex;
+  static const char digits[] = "0123456789abcdef";
+  char line[128];
+  int len = snprintf(line, sizeof(line), "%0*llx  ", h->offwidth,
+                     (unsigned long long)off);
+  int n = h->size - off < NOTEC_HEX_WIDTH ? (int)(h->size - off)
+                                           : NOTEC_HEX_WIDTH;
+  for (int i = 0; i < NOTEC_HEX_WIDTH; i++) {
+    if (i == NOTEC_HEX_WIDTH / 2) line[len++] = ' ';
+    if (i < n) {
+      line[len++] = digits[h->map[off + i] >> 4];
+      line[len++] = digits[h->map[off + i] & 0xf];
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
-      if (len < 0) len = 0;
-      if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
-      int j;
-      for (j = 0; j < len; j++) {
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
-      }
-      abAppend(ab, "\x1b[39m", 5);
+      line[len++] = ' ';
+      line[len++] = ' ';
     }
+    line[len++] = ' ';
+  }
+  line[len++] = '|';
+  for (int i = 0; i < n; i++) {
+    unsigned char c = h->map[off + i];
+    line[len++] = c >= 32 && c < 127 ? c : '.';
+  }
+  line[len++] = '|';
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+  if (len > E.screencols) len = E.screencols;
+  int mark = -1;
+  if (h->cursor >= off && h->cursor < off + n) {
+    int i = h->cursor - off;
+    mark = h->ascii ? editorHexColumn(i) : editorHexAsciiColumn(i);
+  }
+  if (mark < 0 || mark >= len) {
+    abAppend(ab, line, len);
+    return;
   }
+  int w = h->ascii ? 2 : 1;
+  if (w > len - mark) w = len - mark;
+  abAppend(ab, line, mark);
+  abAppend(ab, "\x1b[7m", 4);
+  abAppend(ab, &line[mark], w);
+  abAppend(ab, "\x1b[m", 3);
+  if (len - mark - w > 0) abAppend(ab, &line[mark + w], len - mark - w);
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
+void editorHexDrawStatusBar(struct abuf *ab) {
+  struct hexView *h = &E.cur->hex;
   abAppend(ab, "\x1b[7m", 4);
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    E.filename ? E.filename : "[No Name]", E.numrows,
-    E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-    E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+  int len = snprintf(status, sizeof(status), "%.20s - hex, %zu bytes %s%s",
+                     E.cur->filename, h->size, h->ndirty ? "(modified) " : "",
+                     h->writable ? "" : "[read-only]");
+  int rlen = snprintf(rstatus, sizeof(rstatus), "0x%llx | %d%%",
+                      (unsigned long long)h->cursor,
+                      h->size ? (int)(h->cursor * 100 / h->size) : 100);
   if (len > E.screencols) len = E.screencols;
   abAppend(ab, status, len);
   while (len < E.screencols) {
@@ -830,199 +6674,252 @@ void editorDrawStatusBar(struct abuf *ab) {
   abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols) msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
-}
-
-void editorRefreshScreen() {
-  editorScroll();
-
+void editorHexRefresh() {
+  struct hexView *h = &E.cur->hex;
+  editorHexScroll();
   struct abuf ab = ABUF_INIT;
 
+  if (E.sync_output) abAppend(&ab, "\x1b[?2026h", 8);
   abAppend(&ab, "\x1b[?25l", 6);
   abAppend(&ab, "\x1b[H", 3);
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
+  for (int y = 0; y < E.screenrows; y++) {
+    size_t off = h->top + (size_t)y * NOTEC_HEX_WIDTH;
+    if (off < h->size) editorHexDrawRow(&ab, off);
+    else abAppend(&ab, "~", 1);
+    abAppend(&ab, "\x1b[K\r\n", 5);
+  }
+
+  editorHexDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
 
+  int i = h->cursor % NOTEC_HEX_WIDTH;
+  int x = h->ascii ? editorHexAsciiColumn(i) : editorHexColumn(i) + h->nibble;
+  if (x >= E.screencols) x = E.screencols - 1;
   char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (E.rx - E.coloff) + 1);
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+           (int)((h->cursor - h->top) / NOTEC_HEX_WIDTH) + 1, x + 1);
   abAppend(&ab, buf, strlen(buf));
-
   abAppend(&ab, "\x1b[?25h", 6);
+  if (E.sync_output) abAppend(&ab, "\x1b[?2026l", 8);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  editorQueueFrame(ab.b, ab.len);
 }
 
-void editorSetStatusMessage(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
-  E.statusmsg_time = time(NULL);
+void editorHexMove(long long delta) {
+  struct hexView *h = &E.cur->hex;
+  long long cursor = (long long)h->cursor + delta;
+  if (cursor < 0) cursor = delta < -1 ? (long long)h->cursor % NOTEC_HEX_WIDTH
+                                      : 0;
+  if (h->size == 0) cursor = 0;
+  else if (cursor >= (long long)h->size) cursor = h->size - 1;
+  h->cursor = cursor;
+  h->nibble = 0;
 }
 
-/*** input ***/
-
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
-  size_t bufsize = 128;
-  char *buf = malloc(bufsize);
-
-  size_t buflen = 0;
-  buf[0] = '\0';
+void editorHexPatch(int c) {
+  struct hexView *h = &E.cur->hex;
+  if (h->cursor >= h->size) return;
+  unsigned char *p = &h->map[h->cursor];
+  unsigned char byte;
+  if (h->ascii) {
+    if (c < 32 || c >= 127) return;
+    byte = c;
+  } else {
+    const char *d = c > 0 && c < 128 ? strchr("0123456789abcdef",
+                                              tolower(c)) : NULL;
+    if (d == NULL || *d == '\0') return;
+    int v = d - "0123456789abcdef";
+    byte = h->nibble ? (*p & 0xf0) | v : (*p & 0x0f) | v << 4;
+  }
+  if (byte != *p) {
+    *p = byte;
+    size_t page = h->cursor / h->page;
+    if (!(h->dirty[page / 8] & 1 << (page % 8))) {
+      h->dirty[page / 8] |= 1 << (page % 8);
+      h->ndirty++;
+    }
+  }
+  if (!h->ascii && h->nibble == 0) {
+    h->nibble = 1;
+  } else if (h->cursor + 1 < h->size) {
+    h->cursor++;
+    h->nibble = 0;
+  }
+}
 
-  while (1) {
-    editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+void editorHexSave() {
+  struct hexView *h = &E.cur->hex;
+  if (h->ndirty == 0) {
+    editorSetStatusMessage("No changes to save");
+    return;
+  }
+  if (!h->writable) {
+    editorSetStatusMessage("Can't save! %.20s is read-only", E.cur->filename);
+    return;
+  }
 
-    int c = editorReadKey();
-    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-      if (buflen != 0) buf[--buflen] = '\0';
-    } else if (c == '\x1b') {
-      editorSetStatusMessage("");
-      if (callback) callback(buf, c);
-      free(buf);
-      return NULL;
-    } else if (c == '\r') {
-      if (buflen != 0) {
-        editorSetStatusMessage("");
-        if (callback) callback(buf, c);
-        return buf;
-      }
-    } else if (!iscntrl(c) && c < 128) {
-      if (buflen == bufsize - 1) {
-        bufsize *= 2;
-        buf = realloc(buf, bufsize);
+  size_t written = 0;
+  size_t pg = 0;
+  while (pg < h->npages) {
+    if (!(h->dirty[pg / 8] & 1 << (pg % 8))) {
+      pg++;
+      continue;
+    }
+    size_t first = pg;
+    while (pg < h->npages && h->dirty[pg / 8] & 1 << (pg % 8)) pg++;
+    size_t off = first * h->page;
+    size_t len = (pg * h->page < h->size ? pg * h->page : h->size) - off;
+    while (len > 0) {
+      ssize_t n = pwrite(h->fd, &h->map[off], len, off);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return;
       }
-      buf[buflen++] = c;
-      buf[buflen] = '\0';
+      off += n;
+      len -= n;
+      written += n;
     }
-
-    if (callback) callback(buf, c);
+    for (size_t k = first; k < pg; k++) h->dirty[k / 8] &= ~(1 << (k % 8));
+    h->ndirty -= pg - first;
   }
+  editorSetStatusMessage("%zu bytes written to disk", written);
 }
 
-void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+void editorHexGoTo() {
+  char *query = editorPrompt("Go to offset or N%%: %s", NULL);
+  if (query == NULL) return;
+  char *end;
+  long long n = strtoll(query, &end, 0);
+  if (end == query || n < 0) {
+    editorSetStatusMessage("Bad offset: %s", query);
+  } else if (*end == '%' && end[1] == '\0') {
+    if (n > 100) n = 100;
+    E.cur->hex.cursor = 0;
+    editorHexMove(E.cur->hex.size / 100 * n + E.cur->hex.size % 100 * n / 100);
+  } else if (*end == '\0') {
+    E.cur->hex.cursor = 0;
+    editorHexMove(n);
+  } else {
+    editorSetStatusMessage("Bad offset: %s", query);
+  }
+  free(query);
+}
 
-  switch (key) {
-    case ARROW_LEFT:
-      if (E.cx != 0) {
-        E.cx--;
-      } else if (E.cy > 0) {
-        E.cy--;
-        E.cx = E.row[E.cy].size;
-      }
-      break;
-    case ARROW_RIGHT:
-      if (row && E.cx < row->size) {
-        E.cx++;
-      } else if (row && E.cx == row->size) {
-        E.cy++;
-        E.cx = 0;
-      }
-      break;
-    case ARROW_UP:
-      if (E.cy != 0) {
-        E.cy--;
-      }
-      break;
-    case ARROW_DOWN:
-      if (E.cy < E.numrows) {
-        E.cy++;
+/* Text is searched as typed; "0x" followed by hex digits searches bytes. */
+void editorHexFind() {
+  struct hexView *h = &E.cur->hex;
+  char *query = editorPrompt("Search (text or 0x hex bytes): %s", NULL);
+  if (query == NULL) return;
+
+  char *needle = query;
+  size_t len = strlen(query);
+  if (query[0] == '0' && (query[1] == 'x' || query[1] == 'X') && len > 2) {
+    int odd = len % 2;
+    len = 0;
+    for (char *s = &query[2]; !odd && s[0] && s[1]; s += 2) {
+      if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1])) {
+        len = 0;
+        break;
       }
-      break;
+      char byte[3] = { s[0], s[1], '\0' };
+      needle[len++] = strtol(byte, NULL, 16);
+    }
+    if (len == 0) {
+      editorSetStatusMessage("Bad hex string");
+      free(query);
+      return;
+    }
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-  int rowlen = row ? row->size : 0;
-  if (E.cx > rowlen) {
-    E.cx = rowlen;
+  size_t from = h->cursor + 1;
+  const unsigned char *match = NULL;
+  if (from < h->size)
+    match = memmem(&h->map[from], h->size - from, needle, len);
+  if (match == NULL && from > 0)
+    match = memmem(h->map, from - 1 + len < h->size ? from - 1 + len : h->size,
+                   needle, len);
+  if (match) {
+    h->cursor = match - h->map;
+    h->nibble = 0;
+  } else {
+    editorSetStatusMessage("Not found");
   }
+  free(query);
 }
 
-void editorProcessKeypress() {
+void editorHexProcessKeypress() {
   static int quit_times = NOTEC_QUIT_TIMES;
-
+  struct hexView *h = &E.cur->hex;
   int c = editorReadKey();
 
   switch (c) {
-    case '\r':
-      editorInsertNewline();
-      break;
-
     case CTRL_KEY('q'):
-      if (E.dirty && quit_times > 0) {
+      if (h->ndirty && quit_times > 0) {
         editorSetStatusMessage("WARNING!!! File has unsaved changes. "
           "Press Ctrl-Q %d more times to quit.", quit_times);
         quit_times--;
         return;
       }
+      editorOutputDrain();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
       break;
 
     case CTRL_KEY('s'):
-      editorSave();
+      editorHexSave();
       break;
 
-    case HOME_KEY:
-      E.cx = 0;
+    case ARROW_LEFT:
+      if (!h->ascii && h->nibble) h->nibble = 0;
+      else editorHexMove(-1);
       break;
 
-    case END_KEY:
-      if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+    case ARROW_RIGHT:
+      editorHexMove(1);
       break;
 
-    case CTRL_KEY('f'):
-      editorFind();
+    case ARROW_UP:
+      editorHexMove(-NOTEC_HEX_WIDTH);
       break;
 
-    case BACKSPACE:
-    case CTRL_KEY('h'):
-    case DEL_KEY:
-      if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
-      editorDelChar();
+    case ARROW_DOWN:
+      editorHexMove(NOTEC_HEX_WIDTH);
       break;
 
     case PAGE_UP:
+      editorHexMove(-(long long)E.screenrows * NOTEC_HEX_WIDTH);
+      break;
+
     case PAGE_DOWN:
-      {
-        if (c == PAGE_UP) {
-          E.cy = E.rowoff;
-        } else if (c == PAGE_DOWN) {
-          E.cy = E.rowoff + E.screenrows - 1;
-          if (E.cy > E.numrows) E.cy = E.numrows;
-        }
+      editorHexMove((long long)E.screenrows * NOTEC_HEX_WIDTH);
+      break;
 
-        int times = E.screenrows;
-        while (times--)
-          editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-      }
+    case HOME_KEY:
+      editorHexMove(-(long long)(h->cursor % NOTEC_HEX_WIDTH));
       break;
 
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-      editorMoveCursor(c);
+    case END_KEY:
+      editorHexMove(NOTEC_HEX_WIDTH - 1 - h->cursor % NOTEC_HEX_WIDTH);
       break;
 
-    case CTRL_KEY('l'):
-    case '\x1b':
+    case '\t':
+      h->ascii = !h->ascii;
+      h->nibble = 0;
+      break;
+
+    case CTRL_KEY('g'):
+      editorHexGoTo();
+      break;
+
+    case CTRL_KEY('f'):
+      editorHexFind();
       break;
 
     default:
-      editorInsertChar(c);
+      editorHexPatch(c);
       break;
   }
 
@@ -1037,31 +6934,93 @@ void initEditor() {
   E.rx = 0;
   E.rowoff = 0;
   E.coloff = 0;
-  E.numrows = 0;
-  E.row = NULL;
-  E.dirty = 0;
-  E.filename = NULL;
+  E.wrapoff = 0;
+  E.wrap = 0;
+  E.wrapgen = 0;
+  E.hl_defer = 0;
+  E.bufs = NULL;
+  E.nbufs = 0;
+  E.followall = 0;
+  E.indexall = 0;
+  E.cachebudget = (long long)NOTEC_CACHE_MB << 20;
+  E.cur = editorBufferNew();
+  memset(&E.reg, 0, sizeof(E.reg));
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
-  E.syntax = NULL;
-
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-  E.screenrows -= 2;
+  E.out = (struct frameQueue){ NULL, 0, 0, NULL, 0, 0 };
+  editorInitHighlightEscapes();
+  editorOpenOutput();
+
+  if (getWindowSize(&E.termrows, &E.termcols) == -1) die("getWindowSize");
+  E.termrows -= 1;
+  memset(E.panes, 0, sizeof(E.panes));
+  E.panes[0] = (struct pane){ 1, -1, { -1, -1 }, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                              0, 0, E.cur };
+  E.rootpane = 0;
+  E.curpane = 0;
+  E.wrapcols = E.termcols;
+  editorLayout();
 }
 
 int main(int argc, char *argv[]) {
   enableRawMode();
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  editorInitSyntaxDB();
+  char *filename = NULL;
+  int pager = 0;
+  int hex = 0;
+  for (int j = 1; j < argc; j++) {
+    if (!strcmp(argv[j], "-f")) E.followall = 1;
+    else if (!strcmp(argv[j], "-R")) pager = 1;
+    else if (!strcmp(argv[j], "-I")) E.indexall = 1;
+    else if (!strcmp(argv[j], "-x")) hex = 1;
+    else if (!strcmp(argv[j], "-M") && j + 1 < argc)
+      E.cachebudget = E.cur->cache.budget = (long long)atoi(argv[++j]) << 20;
+    else filename = argv[j];
   }
 
-  editorSetStatusMessage(
-    "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  if (pager)
+    editorSetStatusMessage("HELP: q = quit | / = search | Ctrl-G = go to");
+  else
+    editorSetStatusMessage(
+      "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+
+  signal(SIGPIPE, SIG_IGN);
+  if (filename && !editorFileCodec(filename) &&
+      (hex || (!pager && editorFileIsBinary(filename))))
+    editorHexOpen(filename);
+  else if (filename && pager && !editorFileCodec(filename))
+    editorPagerOpen(filename);
+  else if (filename) editorOpen(filename);
+  if (E.followall && !E.cur->pager.active && !E.cur->hex.active)
+    editorFollowStart();
+  if (E.indexall) editorIndexEnable();
 
   while (1) {
+    editorJournalRecover();
+    editorJournalFlush();
+    editorCheckDisk();
     editorRefreshScreen();
-    editorProcessKeypress();
+    long long frame = editorNowMs();
+    int ev;
+    while ((ev = editorPollInput(editorIndexPending() ? 0
+                                                      : NOTEC_DISK_CHECK_MS)) == 0) {
+      if (editorIndexPending()) {
+        if (editorIndexStep()) break;
+      } else if (editorCheckDisk()) {
+        break;
+      }
+    }
+    /* Keys arriving within a frame of the last refresh are coalesced; after
+     * an idle wait only input that is already pending is drained. */
+    long long burst = editorNowMs();
+    while (1) {
+      if (ev == 1) editorProcessKeypress();
+      if (editorNowMs() - burst >= NOTEC_FRAME_MAX_MS) break;
+      long long wait = frame + NOTEC_FRAME_MS - editorNowMs();
+      ev = editorPollInput(wait > 0 ? wait : 0);
+      if (ev == 0) break;
+    }
   }
 
   return 0;